@@ -1,10 +1,8 @@
 #include <ester.h>
 #include <matplotlib.h>
-
-#include <iomanip>
+#include "solver_context.hpp"
 
 extern void create_map(mapping& map);
-extern solver *create_solver();
 
 matrix Phi;
 matrix Phi0;
@@ -12,10 +10,6 @@ matrix Lambda;
 double n = 1.5;
 
 int main(int argc, char *arg[]) {
-    int it = 0;
-    double error = 1.;
-    double tol = 1e-12;
-
     mapping map;
     create_map(map);
 
@@ -23,48 +17,21 @@ int main(int argc, char *arg[]) {
     Phi0 = zeros(1, 1);
     Lambda = ones(1, 1);
 
-    std::cout << std::scientific;
-    std::vector<double> errors;
-    while (error > tol) {
-        solver *s = create_solver();
-        s->solve();
-
-        matrix dPhi = s->get_var("Phi");
-        error = max(abs(dPhi));
-        errors.push_back(error);
-        std::cout << "Iter" << std::setw(3) << ++it << " error: " << error << '\n';
-
-        double relax = 1.;
-        if(error>0.01) relax = 0.2; // Relax if error too large
-
-        Phi += relax*dPhi;
-        Phi0 += relax*s->get_var("Phi0")(0);
-        Lambda += relax*s->get_var("Lambda")(0);
-
-        delete s;
-
-        if (it > 1000) break;
-    }
-
-    if (error > tol) {
+    // generated by ester-lang -newton
+    newton_stats stats = newton_solve(1e-12, 100, 1);
+    if (!stats.converged) {
         printf("No converge\n");
         return 1;
     }
+    printf("Converged in %d iterations (%d line search backtracks, "
+            "%d failed line searches)\n",
+            stats.iterations, stats.backtracks, stats.failed_searches);
 
     plt::init();
-    plt::subplot(211);
 
     plt::plot(map.r, Phi, "$\\Phi$");
     plt::legend();
 
-    matrix error_matrix(errors.size(), 1);
-    for (size_t i=0; i<errors.size(); i++)
-        error_matrix(i) = errors[i];
-
-    plt::subplot(212);
-    plt::plot(error_matrix, "Error");
-    plt::legend();
-
     printf("\n");
     printf("Lambda = %f\n", Lambda(0));
     printf("Phi(0) = %f\n", Phi(0));
@@ -0,0 +1,194 @@
+#include "cache.hpp"
+#include "jit.hpp"
+#include "log.hpp"
+#include "solver.hpp"
+#include "config.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool make_dirs(const std::string& dir) {
+    for (size_t i=1; i<=dir.size(); i++) {
+        if (i < dir.size() && dir[i] != '/') continue;
+        std::string d = dir.substr(0, i);
+        if (mkdir(d.c_str(), 0755) && errno != EEXIST) return false;
+    }
+    return true;
+}
+
+std::string temp_path(const std::string& path) {
+    static std::atomic<int> n(0);
+    return path + "." + std::to_string(getpid()) + "." + std::to_string(n++);
+}
+
+bool read_file(const std::string& path, std::string& content) {
+    std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+    if (!file.is_open()) return false;
+    std::ostringstream s;
+    s << file.rdbuf();
+    content = s.str();
+    return true;
+}
+
+bool write_if_changed(const std::string& path, const std::string& content) {
+    std::string old;
+    if (read_file(path, old) && old == content) return true;
+    std::ofstream file(path.c_str(), std::ios::out | std::ios::binary);
+    file << content;
+    file.close();
+    if (!file) {
+        log::err() << "Could not write " << path << '\n';
+        return false;
+    }
+    return true;
+}
+
+bool write_depfile(const std::string& path, const std::string& target,
+        const std::vector<std::string>& deps) {
+    std::ostringstream s;
+    s << target << ":";
+    for (auto& d: deps)
+        s << " \\\n  " << d;
+    s << "\n";
+    for (auto& d: deps)
+        s << "\n" << d << ":\n";
+    return write_if_changed(path, s.str());
+}
+
+source_cache::source_cache() : dir(jit::default_cache_dir() + "/sources") { }
+
+source_cache::source_cache(const std::string& dir) : dir(dir) { }
+
+std::vector<std::string> source_cache::templates() {
+    std::vector<std::string> files;
+    for (auto name: {"mapping.cpp", "simd.hpp", "solver_context.hpp",
+            "newton.cpp", "et.hpp"}) {
+        files.push_back(ir::templates_dir() + "/" + name);
+    }
+    return files;
+}
+
+std::string source_cache::normalize(const char *input, size_t size) {
+    std::string s;
+    bool comment = false, blank = false;
+    for (size_t i=0; i<size; i++) {
+        char c = input[i];
+        if (c == '\n') {
+            // lines are kept: cached warnings refer to them
+            comment = blank = false;
+            s += c;
+            continue;
+        }
+        if (comment) continue;
+        if (c == '#' || (c == '/' && i+1 < size && input[i+1] == '/')) {
+            comment = true;
+            continue;
+        }
+        if (c == ' ' || c == '\t' || c == '\r') {
+            blank = true;
+            continue;
+        }
+        if (blank && s.size() && s.back() != '\n') s += ' ';
+        blank = false;
+        s += c;
+    }
+    return s;
+}
+
+// path of the running ester-lang: the object holding this function
+static std::string executable() {
+    if (access("/proc/self/exe", R_OK) == 0) return "/proc/self/exe";
+    Dl_info info;
+    if (dladdr((void *) &executable, &info) && info.dli_fname)
+        return info.dli_fname;
+    return "";
+}
+
+// hash of what generated code depends on besides the model and the options,
+// computed once per process
+static uint64_t generator_hash() {
+    uint64_t h = jit::hash(PACKAGE_VERSION);
+    std::string content;
+    for (auto& t: source_cache::templates()) {
+        if (read_file(t, content))
+            h = jit::hash(std::string(1, '\0') + content, h);
+    }
+    // a rebuilt ester-lang may generate different code: the executable is
+    // hashed, or its size and modification time if it cannot be read
+    std::string exe = executable();
+    struct stat st;
+    if (read_file(exe, content)) {
+        h = jit::hash(std::string(1, '\0') + content, h);
+    }
+    else if (exe != "" && stat(exe.c_str(), &st) == 0) {
+        h = jit::hash(std::string(1, '\0') + std::to_string(st.st_size)
+                + " " + std::to_string(st.st_mtime), h);
+    }
+    else {
+        log::warn() << "Could not identify ester-lang, use -no-cache after "
+            "rebuilding it\n";
+    }
+    return h;
+}
+
+std::string source_cache::key(const char *input, size_t size,
+        const std::string& options) {
+    static const uint64_t generator = generator_hash();
+    uint64_t h = jit::hash(normalize(input, size), generator);
+    h = jit::hash(std::string(1, '\0') + options, h);
+
+    std::ostringstream key;
+    key << std::hex;
+    key.width(16);
+    key.fill('0');
+    key << h;
+    return key.str();
+}
+
+bool source_cache::find(const std::string& key, std::string& code,
+        std::vector<std::string>& warnings) {
+    if (!read_file(dir + "/" + key + ".cpp", code)) return false;
+    // written before the code, there are none if the file does not exist
+    std::string content;
+    warnings.clear();
+    if (read_file(dir + "/" + key + ".warn", content)) {
+        std::istringstream s(content);
+        std::string line;
+        while (std::getline(s, line))
+            warnings.push_back(line);
+    }
+    return true;
+}
+
+// written aside then renamed, a concurrent reader never sees a partial file
+static bool store_file(const std::string& path, const std::string& content) {
+    std::string tmp = temp_path(path);
+    std::ofstream file(tmp.c_str(), std::ios::out | std::ios::binary);
+    file << content;
+    file.close();
+    if (!file || std::rename(tmp.c_str(), path.c_str())) {
+        std::remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+void source_cache::store(const std::string& key, const std::string& code,
+        const std::vector<std::string>& warnings) {
+    if (!make_dirs(dir)) return;
+    if (warnings.size()) {
+        std::string content;
+        for (auto& w: warnings)
+            content += w + '\n';
+        if (!store_file(dir + "/" + key + ".warn", content)) return;
+    }
+    store_file(dir + "/" + key + ".cpp", code);
+}
@@ -0,0 +1,67 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <string>
+#include <vector>
+
+///
+/// \brief Cache of generated sources, addressed by the content of what they
+/// are generated from
+///
+/// The key of a source is a hash of the normalized model (comments and
+/// blank differences within lines do not matter), of the code generation
+/// options, of the templates written in generated code and of the
+/// ester-lang executable itself.
+///
+/// A cached source is returned without parsing its model, the warnings of
+/// the parse are cached with it so that they can be reported again (lines
+/// are kept by the normalization, their numbers still hold).
+///
+class source_cache {
+    public:
+        source_cache();
+        source_cache(const std::string& dir);
+
+        /// \brief Key of the code generated from model `input' (the `size'
+        /// bytes of the file) with `options'
+        std::string key(const char *input, size_t size,
+                const std::string& options);
+
+        /// \brief Reads the code cached under `key' and the warnings of its
+        /// parse, returns false if there is none
+        bool find(const std::string& key, std::string& code,
+                std::vector<std::string>& warnings);
+        void store(const std::string& key, const std::string& code,
+                const std::vector<std::string>& warnings);
+
+        /// \brief Template files generated code depends on
+        static std::vector<std::string> templates();
+
+        /// \brief Removes comments and collapses blanks of a model, keeping
+        /// its lines
+        static std::string normalize(const char *input, size_t size);
+
+    private:
+        std::string dir;
+};
+
+/// \brief Creates directory `dir' and its parents
+bool make_dirs(const std::string& dir);
+
+/// \brief Name of a temporary file to write before renaming it to `path',
+/// unique to the calling process and thread
+std::string temp_path(const std::string& path);
+
+/// \brief Reads file `path' in `content'
+bool read_file(const std::string& path, std::string& content);
+
+/// \brief Writes `content' to `path' unless the file already holds it, so
+/// that its modification time only changes with its content
+bool write_if_changed(const std::string& path, const std::string& content);
+
+/// \brief Writes a make rule stating that `target' depends on `deps', with
+/// an empty rule per dependency so that removed files do not break builds
+bool write_depfile(const std::string& path, const std::string& target,
+        const std::vector<std::string>& deps);
+
+#endif
@@ -1,28 +1,97 @@
 #include "frontend.hpp"
 #include "ir.hpp"
 
-namespace yacc {
-    std::string filename = "";
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+mapped_file::~mapped_file() {
+    if (mapped) munmap(base, mapped);
+}
+
+bool mapped_file::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    bool r = open(fd);
+    close(fd);
+    return r;
 }
 
-frontend::~frontend() {
-    if (yyin) {
-        fclose(yyin);
-        yyin = NULL;
-        yacc::filename = "";
+bool mapped_file::open(int fd) {
+    struct stat st;
+    if (fstat(fd, &st)) return false;
+    if (S_ISREG(st.st_mode)) {
+        // the two null bytes may lie past the last page of the file: an
+        // anonymous (zeroed) mapping is reserved first, the file is then
+        // mapped over its beginning
+        len = st.st_size;
+        mapped = len + 2;
+        void *p = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            mapped = 0;
+            return false;
+        }
+        base = (char *) p;
+        if (len > 0 && mmap(base, len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            return false;
+        }
+        return true;
     }
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return false;
+        content.append(buf, n);
+    }
+    len = content.size();
+    content.append(2, '\0');
+    base = &content[0];
+    return true;
 }
 
 int frontend::parse(const std::string& filename) {
-    yyin = fopen(filename.c_str(), "r");
-    yacc::filename = filename;
-    if (yyin == NULL) {
+    mapped_file file;
+    if (!file.open(filename)) {
         std::cerr << "Opening file `" << filename << "' failed\n";
         return 1;
     }
-    if (yyparse(&solver)) {
-        return 1;
-    }
-    return 0;
+    return parse(file, filename);
 }
 
+int frontend::parse(mapped_file& file, const std::string& name) {
+    parse_ctx.filename = name;
+    void *scanner;
+    yylex_init_extra(&parse_ctx, &scanner);
+    scan_buffer(file.data(), file.size(), scanner);
+    return parse(scanner);
+}
+
+int frontend::parse_string(const char *data, size_t size,
+        const std::string& name) {
+    parse_ctx.filename = name;
+    void *scanner;
+    yylex_init_extra(&parse_ctx, &scanner);
+    scan_bytes(data, size, scanner);
+    return parse(scanner);
+}
+
+int frontend::parse(void *scanner) {
+    parse_ctx.solver = &solver;
+    int r;
+    try {
+        r = yyparse(scanner, &parse_ctx);
+    }
+    catch (...) {
+        // error() in an action, the model is abandoned
+        yylex_destroy(scanner);
+        throw;
+    }
+    yylex_destroy(scanner);
+    return r ? 1 : 0;
+}
@@ -2,32 +2,140 @@
 #define FRONTEND_H
 
 #include "solver.hpp"
+#include "et_backend.hpp"
 
 #include <list>
 #include "parser.hpp"
 
 #include <string>
+#include <vector>
 
 namespace yacc {
-    extern std::string filename;
+    ///
+    /// \brief State of a parse, shared by the scanner and the parser
+    ///
+    /// Each frontend owns its own, so that several models can be parsed at
+    /// once (by different threads).
+    ///
+    struct parse_context {
+        std::string filename;
+        ir::solver *solver = NULL;
+        int nbc = 0;        ///< number of boundary conditions parsed
+        std::vector<std::string> warnings;  ///< as "line: message"
+    };
 };
 
-extern FILE *yyin;
-extern int yyparse();
+// reentrant scanner interface (generated by flex)
+int yylex(YYSTYPE *lval, void *scanner);
+int yylex_init_extra(yacc::parse_context *ctx, void **scanner);
+int yylex_destroy(void *scanner);
+int yyget_lineno(void *scanner);
+// scans `size' bytes at `base' in place, base[size] and base[size+1] must be
+// null (defined in scanner.lpp)
+void scan_buffer(char *base, size_t size, void *scanner);
+// scans a copy of `size' bytes at `bytes'
+void scan_bytes(const char *bytes, size_t size, void *scanner);
+
+///
+/// \brief Content of a file, followed by two null bytes as flex requires to
+/// scan it in place
+///
+/// Regular files are memory-mapped (privately: the scanner writes in the
+/// buffer while scanning), other files (pipes, terminals) are read.
+///
+class mapped_file {
+    public:
+        mapped_file() { }
+        ~mapped_file();
+        mapped_file(const mapped_file& f) = delete;
+
+        /// \brief Maps (or reads) file `path', returns false on error
+        bool open(const std::string& path);
+        /// \brief Maps (or reads) open file descriptor `fd', which is not
+        /// closed
+        bool open(int fd);
+
+        char *data() { return base; }
+        size_t size() const { return len; }
+
+    private:
+        char *base = NULL;
+        size_t len = 0;
+        size_t mapped = 0;  // length of the mapping, 0 if read
+        std::string content;
+};
 
 class frontend {
     public:
-        int parse(const std::string&);
-        ~frontend();
+        /// \brief Parses the model in file `filename'
+        int parse(const std::string& filename);
+
+        /// \brief Parses the model in `file' in place, `name' is used in
+        /// messages. The content of the file is altered while it is scanned.
+        int parse(mapped_file& file, const std::string& name);
+
+        /// \brief Parses the model in the `size' bytes at `data' (copied)
+        int parse_string(const char *data, size_t size,
+                const std::string& name = "<string>");
+        int parse_string(const std::string& model,
+                const std::string& name = "<string>") {
+            return parse_string(model.data(), model.size(), name);
+        }
         void info() {
             solver.info();
         }
 
-        void emit_code(std::ostream& os) { solver.emit_code(os); }
+        /// \brief Warnings of the parses, as "line: message"
+        const std::vector<std::string>& warnings() const {
+            return parse_ctx.warnings;
+        }
+
+        void emit_code(std::ostream& os) {
+            if (backend == "et") {
+                ir::et_backend et(solver);
+                et.emit_code(os);
+            }
+            else {
+                solver.emit_code(os);
+            }
+        }
+
+        /// \brief Selects the generated code: "ester" (libester solver) or
+        /// "et" (self-contained expression templates)
+        int set_backend(const std::string& name) {
+            if (name != "ester" && name != "et") return 1;
+            backend = name;
+            return 0;
+        }
+
+        /// \brief Also generates a Newton driver, newton_solve()
+        void set_newton_driver(bool enable) {
+            solver.set_newton_driver(enable);
+        }
+
+        /// \brief Makes the Newton driver reuse operators across iterations
+        void set_reuse_jacobian(bool enable) {
+            solver.set_reuse_jacobian(enable);
+        }
+
+        /// \brief Generates multithreaded assembly (OpenMP)
+        void set_parallel(bool enable) { solver.set_parallel(enable); }
+
+        /// \brief Prints the number of IR nodes and the memory they use
+        void mem_info() {
+            log::log() << "IR: " << ctx.n_nodes() << " nodes, "
+                << ctx.bytes() << " bytes\n";
+        }
 
     private:
-        std::shared_ptr<const ir::ast> ast;
+        // the IR is released when the frontend is destroyed
+        ir::context ctx;
         ir::solver solver;
+        yacc::parse_context parse_ctx;
+
+        // runs the parser on `scanner' (whose input is set), destroys it
+        int parse(void *scanner);
+        std::string backend = "ester";
 };
 
 #endif
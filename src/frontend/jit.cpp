@@ -0,0 +1,155 @@
+#include "jit.hpp"
+#include "cache.hpp"
+#include "log.hpp"
+#include "solver.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+jit::jit() : jit(default_cache_dir()) { }
+
+// kernels are vectorized as in the samples (see templates/simd.hpp)
+jit::jit(const std::string& cache_dir) : cache_dir(cache_dir),
+    cxx(JIT_CXX), flags(JIT_CXXFLAGS + " -fopenmp-simd -fno-math-errno -I"
+            + ir::templates_dir()), parallel(false) {
+    if (const char *extra = std::getenv("ESTER_JIT_FLAGS"))
+        flags += std::string(" ") + extra;
+}
+
+jit::~jit() {
+    for (auto m: modules)
+        dlclose(m);
+}
+
+std::string jit::default_cache_dir() {
+    if (const char *dir = std::getenv("ESTER_LANG_CACHE"))
+        return dir;
+    if (const char *dir = std::getenv("XDG_CACHE_HOME"))
+        return std::string(dir) + "/ester-lang";
+    if (const char *home = std::getenv("HOME"))
+        return std::string(home) + "/.cache/ester-lang";
+    return "/tmp/ester-lang";
+}
+
+uint64_t jit::hash(const std::string& s, uint64_t h) {
+    if (h == 0) h = 14695981039346656037ULL;
+    for (unsigned char c: s) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static bool file_exists(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+// output of shell command `cmd', empty if it fails
+static std::string run(const std::string& cmd) {
+    std::string out;
+    FILE *p = popen(cmd.c_str(), "r");
+    if (p == NULL) return out;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), p)) > 0)
+        out.append(buf, n);
+    if (pclose(p) != 0) out.clear();
+    return out;
+}
+
+uint64_t jit::toolchain_hash(const std::string& command) {
+    // computed once per compiler command, models of a batch share it
+    static std::mutex lock;
+    static std::map<std::string, uint64_t> hashes;
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = hashes.find(command);
+    if (it != hashes.end()) return it->second;
+
+    uint64_t h = hash(run(cxx + " --version 2>&1"));
+    // headers found for ester.h (-M lists them after "-:"), an empty list
+    // if libester is not installed
+    std::istringstream deps(run("echo '#include <ester.h>' | " + command
+                + " -M -x c++ - 2>/dev/null"));
+    std::string dep, content;
+    while (deps >> dep) {
+        if (dep == "\\" || dep[dep.size() - 1] == ':') continue;
+        h = hash(std::string(1, '\0') + dep, h);
+        if (read_file(dep, content)) h = hash(content, h);
+    }
+    hashes[command] = h;
+    return h;
+}
+
+std::string jit::build(const std::string& code) {
+    // the compiler command, its version and the headers of libester are
+    // part of the key: other compiler or library, other module
+    std::string command = cxx + " " + flags + (parallel ? " -fopenmp" : "");
+    uint64_t h = hash(code, toolchain_hash(command));
+    h = hash(std::string(1, '\0') + command, h);
+    std::ostringstream key;
+    key << std::hex;
+    key.width(16);
+    key.fill('0');
+    key << h;
+
+    std::string base = cache_dir + "/" + key.str();
+    std::string so = base + ".so";
+    if (file_exists(so)) return so;
+
+    if (!make_dirs(cache_dir)) {
+        log::err() << "Could not create cache directory " << cache_dir
+            << '\n';
+        return "";
+    }
+    // concurrent builds of a same module each write their own files, the
+    // module is then renamed atomically
+    std::string src = temp_path(base) + ".cpp";
+    std::ofstream file(src.c_str());
+    file << code;
+    file.close();
+    if (!file) {
+        log::err() << "Could not write " << src << '\n';
+        std::remove(src.c_str());
+        return "";
+    }
+
+    std::string tmp = temp_path(so);
+    std::string cmd = command + " -shared -fPIC -o '" + tmp + "' '" + src
+        + "'";
+    int r = std::system(cmd.c_str());
+    // the source is kept next to the module
+    std::rename(src.c_str(), (base + ".cpp").c_str());
+    if (r != 0) {
+        log::err() << "Compilation failed: " << base << ".cpp\n";
+        std::remove(tmp.c_str());
+        return "";
+    }
+    if (std::rename(tmp.c_str(), so.c_str())) {
+        log::err() << "Could not create " << so << '\n';
+        std::remove(tmp.c_str());
+        return "";
+    }
+    return so;
+}
+
+void *jit::load(const std::string& code) {
+    std::string so = build(code);
+    if (so == "") return NULL;
+    void *m = dlopen(so.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (m == NULL) {
+        log::err() << "Could not load " << so << ": " << dlerror() << '\n';
+        return NULL;
+    }
+    modules.push_back(m);
+    return m;
+}
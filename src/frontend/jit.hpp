@@ -0,0 +1,56 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+///
+/// \brief Compiles generated code to a shared object and loads it
+///
+/// Shared objects are cached on disk, named after a hash of the generated
+/// code (hence of the IR and of the code generation options), of the
+/// compiler command and version and of the libester headers: building a
+/// model that did not change does not run the compiler.
+///
+/// Code generated by the libester backend refers to the variables of the
+/// program loading it, which then has to export them (-rdynamic).
+///
+class jit {
+    public:
+        jit();
+        jit(const std::string& cache_dir);
+        ~jit();
+        jit(const jit& j) = delete;
+
+        void set_compiler(const std::string& cxx) { this->cxx = cxx; }
+        void set_flags(const std::string& flags) { this->flags = flags; }
+        /// \brief Compiles with OpenMP, for code generated with
+        /// solver::set_parallel
+        void set_parallel(bool enable) { parallel = enable; }
+
+        /// \brief Returns the path of the shared object compiled from
+        /// `code', or an empty string if compilation failed
+        std::string build(const std::string& code);
+
+        /// \brief Builds `code' and loads it, returns the handle to use with
+        /// dlsym() (NULL on error). Modules are unloaded with the jit object.
+        void *load(const std::string& code);
+
+        /// \brief $ESTER_LANG_CACHE, or ester-lang in the user cache directory
+        static std::string default_cache_dir();
+
+        /// \brief 64-bit FNV-1a hash, stable across runs and platforms
+        static uint64_t hash(const std::string& s, uint64_t h = 0);
+
+    private:
+        std::string cache_dir;
+        std::string cxx;
+        std::string flags;
+        bool parallel;
+        std::vector<void *> modules;
+
+        uint64_t toolchain_hash(const std::string& command);
+};
+
+#endif
@@ -1,48 +1,314 @@
 #include "frontend.hpp"
 #include "log.hpp"
 #include "args.hpp"
+#include "jit.hpp"
+#include "cache.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstring>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <thread>
+
+// code generation settings, common to all the models of a run
+struct settings {
+    bool newton;
+    bool modified_newton;
+    bool parallel;
+    bool jit;
+    bool use_cache;
+    std::string backend;
+    std::string options;    // settings that change the generated code
+    int verbosity;
+};
+
+// generates the code of model `input' (standard input if "-"), or compiles
+// it in JIT mode and returns the path of the shared object. Returns 0 on
+// success or 1 with a message in `msg' (empty for syntax errors, which the
+// parser reports).
+static int compile(const std::string& input, const settings& s,
+        std::string& code, std::string& msg) {
+    try {
+        frontend f;
+        f.set_newton_driver(s.newton || s.modified_newton);
+        f.set_reuse_jacobian(s.modified_newton);
+        f.set_parallel(s.parallel);
+        f.set_backend(s.backend);
+
+        mapped_file model;
+        std::string name = (input == "-") ? "<stdin>" : input;
+        if (!((input == "-") ? model.open(0) : model.open(input))) {
+            msg = "could not read " + name;
+            return 1;
+        }
+
+        // generated code is looked up in the cache first, verbose runs
+        // always parse as they report on the model
+        source_cache cache;
+        std::string key;
+        std::vector<std::string> warnings;
+        bool use_cache = s.use_cache && s.verbosity == 0;
+        if (use_cache) key = cache.key(model.data(), model.size(), s.options);
+        if (use_cache && cache.find(key, code, warnings)) {
+            // the model is not parsed again, its warnings are replayed
+            for (auto& w: warnings)
+                log::warn() << name << ":" << w << '\n';
+        }
+        else {
+            if (f.parse(model, name)) return 1;
+            if (s.verbosity > 0) f.info();
+            std::ostringstream os;
+            f.emit_code(os);
+            code = os.str();
+            if (use_cache) cache.store(key, code, f.warnings());
+            if (s.verbosity > 0) f.mem_info();
+        }
+
+        if (s.jit) {
+            // compiles the model (unless it is cached) and outputs the path
+            // of the shared object
+            jit j;
+            j.set_parallel(s.parallel);
+            std::string module = j.build(code);
+            if (module == "") {
+                msg = "compilation failed";
+                return 1;
+            }
+            code = module + '\n';
+        }
+    }
+    catch (log::fatal_error& e) {
+        msg = e.what();
+        return 1;
+    }
+    catch (std::exception& e) {
+        // in batch mode, an exception leaving a worker would terminate the
+        // whole run
+        msg = std::string("unexpected error: ") + e.what();
+        return 1;
+    }
+    return 0;
+}
+
+// directory part of `path', with its trailing slash
+static std::string dirname(const std::string& path) {
+    size_t i = path.rfind('/');
+    return (i == std::string::npos) ? "" : path.substr(0, i + 1);
+}
+
+// adds `input' to the models to compile, or the models it lists if it is
+// a manifest (@file: one model per line, relative to the manifest, @- reads
+// the list on standard input)
+static int add_inputs(const std::string& input,
+        std::vector<std::string>& models) {
+    if (input.size() < 2 || input[0] != '@') {
+        models.push_back(input);
+        return 0;
+    }
+    std::string manifest = input.substr(1);
+    std::string content;
+    if (manifest == "-") {
+        std::ostringstream s;
+        s << std::cin.rdbuf();
+        content = s.str();
+        manifest = "";
+    }
+    else if (!read_file(manifest, content)) {
+        log::err() << "Could not read manifest " << manifest << '\n';
+        return 1;
+    }
+    std::istringstream lines(content);
+    std::string line;
+    while (std::getline(lines, line)) {
+        std::istringstream words(line.substr(0, line.find('#')));
+        std::string model;
+        if (!(words >> model)) continue;
+        if (model[0] != '/') model = dirname(manifest) + model;
+        models.push_back(model);
+    }
+    return 0;
+}
+
+// compiles `models' with `jobs' threads, writing model dir/m.eq to
+// outdir/m.cpp (dir/m.cpp if outdir is empty), then prints a report
+static int batch(const std::vector<std::string>& models,
+        const std::string& outdir, int jobs, const settings& s) {
+    struct result {
+        std::string output;
+        std::string msg;
+        double time = 0;
+        int r = 0;
+    };
+    std::vector<result> results(models.size());
+
+    // models writing the same output (same name in different directories
+    // with a common outdir, or a model listed twice) would overwrite each
+    // other concurrently: none of them is compiled
+    if (!s.jit) {
+        std::map<std::string, std::vector<size_t>> writers;
+        for (size_t i=0; i<models.size(); i++) {
+            std::string dir = dirname(models[i]);
+            std::string name = models[i].substr(dir.size());
+            name = name.substr(0, name.rfind('.'));
+            if (outdir != "") dir = outdir + "/";
+            results[i].output = dir + name + ".cpp";
+            writers[results[i].output].push_back(i);
+        }
+        for (auto& w: writers) {
+            if (w.second.size() < 2) continue;
+            for (auto i: w.second) {
+                results[i].r = 1;
+                results[i].msg = "output " + w.first
+                    + " is written by several models";
+            }
+        }
+    }
+    std::atomic<size_t> next(0);
+
+    auto worker = [&]() {
+        size_t i;
+        while ((i = next++) < models.size()) {
+            auto start = std::chrono::steady_clock::now();
+            result& res = results[i];
+            if (res.r) continue;
+            std::string code;
+            res.r = compile(models[i], s, code, res.msg);
+            if (res.r == 0 && s.jit) {
+                res.output = code.substr(0, code.size() - 1);
+            }
+            else if (res.r == 0) {
+                if (!write_if_changed(res.output, code)) {
+                    res.msg = "could not write " + res.output;
+                    res.r = 1;
+                }
+            }
+            std::chrono::duration<double> t =
+                std::chrono::steady_clock::now() - start;
+            res.time = t.count();
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    if (jobs <= 0) jobs = std::max(1u, std::thread::hardware_concurrency());
+    jobs = std::min<size_t>(jobs, models.size());
+    std::vector<std::thread> pool;
+    for (int i=1; i<jobs; i++)
+        pool.push_back(std::thread(worker));
+    worker();
+    for (auto& t: pool)
+        t.join();
+    std::chrono::duration<double> t = std::chrono::steady_clock::now() - start;
+
+    int failed = 0;
+    for (size_t i=0; i<models.size(); i++) {
+        const result& res = results[i];
+        log::log() << std::fixed << std::setprecision(3) << std::setw(8)
+            << res.time << " s  ";
+        if (res.r) {
+            failed++;
+            log::log() << termcolor::bold << termcolor::red << "FAILED"
+                << termcolor::reset << "  " << models[i] << ": "
+                << (res.msg == "" ? "parsing failed" : res.msg) << '\n';
+        }
+        else {
+            log::log() << "ok      " << models[i] << " -> " << res.output
+                << '\n';
+        }
+    }
+    log::log() << models.size() << " models, " << failed << " failed, in "
+        << t.count() << " s (" << jobs << " threads)\n";
+    return failed ? 1 : 0;
+}
 
 int main(int argc, char *argv[]) {
     cmdline::args args;
     args.add_pos_arg("filename");
+    args.allow_extra_pos_args();
     args.add_opt("o", cmdline::required_argument);
     args.add_opt("v", "0", cmdline::optional_argument);
-    int verbosity = 0;
+    args.add_opt("newton", "0", cmdline::no_argument);
+    args.add_opt("modified-newton", "0", cmdline::no_argument);
+    args.add_opt("parallel", "0", cmdline::no_argument);
+    args.add_opt("backend", "ester", cmdline::required_argument);
+    args.add_opt("jit", "0", cmdline::no_argument);
+    args.add_opt("no-cache", "0", cmdline::no_argument);
+    args.add_opt("dep", cmdline::required_argument);
+    args.add_opt("batch", "0", cmdline::no_argument);
+    args.add_opt("j", "0", cmdline::required_argument);
     if (args.parse(argc, argv)) {
         std::exit(EXIT_FAILURE);
     }
     std::string output = args.get("o");
+    std::string depfile = args.get("dep");
+    bool batch_mode = args.get("batch") != "0";
+
+    // a flag given on the command line reads as an empty string
+    settings s;
+    s.newton = args.get("newton") != "0";
+    s.modified_newton = args.get("modified-newton") != "0";
+    s.parallel = args.get("parallel") != "0";
+    s.jit = args.get("jit") != "0";
+    s.use_cache = args.get("no-cache") == "0";
+    s.backend = args.get("backend");
+    for (auto opt: {"newton", "modified-newton", "parallel", "backend"})
+        s.options += std::string(opt) + "=" + args.get(opt) + ";";
     try {
-        verbosity = std::stoi(args.get("v"));
+        s.verbosity = std::stoi(args.get("v"));
     }
     catch (std::invalid_argument) {
-        verbosity = 1;
+        s.verbosity = 1;
     }
 
-    std::ofstream ofile;
-    if (output != "") {
-        ofile.open(output, std::ios::out);
+    if (frontend().set_backend(s.backend)) {
+        log::err() << "Unknown backend `" << s.backend
+            << "' (ester or et)\n";
+        std::exit(EXIT_FAILURE);
+    }
+    if (depfile != "" && (output == "" || batch_mode)) {
+        log::err() << "-dep requires -o, and no -batch\n";
+        std::exit(EXIT_FAILURE);
     }
-    std::ostream& os = (output == "")?std::cout:ofile;
 
-    int r;
-    {
-        frontend f;
-        std::string input = args.get("filename");
-        if (input == "-") {
-            log::log() << "Reading from standard input\n";
-            r = f.parse("/dev/stdin");
+    int r = 0;
+    std::string input = args.get("filename");
+    if (batch_mode) {
+        std::vector<std::string> models;
+        r |= add_inputs(input, models);
+        for (auto& i: args.get_extra_pos_args())
+            r |= add_inputs(i, models);
+        // models report on the standard output of the batch
+        s.verbosity = 0;
+        if (r == 0)
+            r = batch(models, output, std::atoi(args.get("j").c_str()), s);
+    }
+    else {
+        std::string ignored;
+        for (auto& a: args.get_extra_pos_args())
+            ignored += " " + a;
+        if (ignored != "") {
+            log::warn() << "Ignoring command line arguments:" << ignored
+                << " (use -batch to compile several models)\n";
         }
-        else {
-            r = f.parse(input);
-            if (r == 0) {
-                if (verbosity > 0) f.info();
-                f.emit_code(os);
-                if (ofile.is_open())
-                    ofile.close();
-            }
+        std::string code, msg;
+        r = compile(input, s, code, msg);
+        if (r) {
+            if (msg != "") log::err() << msg << '\n';
+        }
+        else if (output == "") {
+            std::cout << code;
+        }
+        else if (!write_if_changed(output, code)) {
+            r = 1;
+        }
+        else if (depfile != "") {
+            std::vector<std::string> deps;
+            if (input != "-") deps.push_back(input);
+            for (auto& t: source_cache::templates())
+                deps.push_back(t);
+            if (!write_depfile(depfile, output, deps)) r = 1;
         }
     }
     if (ir::n_nodes > 0) {
@@ -0,0 +1,137 @@
+#include "frontend.hpp"
+#include "jit.hpp"
+#include "log.hpp"
+
+#include <cstdlib>
+#include <sstream>
+
+#include <dlfcn.h>
+#include <sys/stat.h>
+
+// layout of the ester_state generated for the model of test_jit
+struct state {
+    int npts;
+    const double *r;
+    const double *D;
+    const double *x;
+};
+
+static std::string generate(const std::string& model,
+        bool parallel = false) {
+    frontend f;
+    f.set_backend("et");
+    f.set_parallel(parallel);
+    if (f.parse_string(model, "test.eq"))
+        error("parsing failed");
+    std::ostringstream os;
+    f.emit_code(os);
+    return os.str();
+}
+
+// the code generated by the expression template backend does not depend on
+// libester: it is compiled and called here
+void test_jit(const std::string& cache_dir) {
+    std::string code = generate("var field: x\n"
+            "equation x {\n"
+            "    x = 2\n"
+            "}\n");
+
+    jit j1(cache_dir);
+    std::string so = j1.build(code);
+    struct stat st1, st2;
+    if (so == "" || stat(so.c_str(), &st1))
+        error("JIT compilation failed");
+
+    // the second build finds the module of the first one in the cache
+    jit j2(cache_dir);
+    if (j2.build(code) != so || stat(so.c_str(), &st2)
+            || st1.st_ino != st2.st_ino || st1.st_mtime != st2.st_mtime)
+        error("JIT cache missed");
+
+    void *m = j2.load(code);
+    if (m == NULL)
+        error("JIT module not loaded");
+    typedef void (*residual_fn)(const state&, double *);
+    auto residual = (residual_fn) dlsym(m, "residual_x");
+    if (residual == NULL)
+        error("residual_x not found in JIT module");
+
+    const int n = 3;
+    double r[n] = {0., .5, 1.}, D[n*n] = {0.}, x[n] = {1., 2., 3.};
+    double rhs[n];
+    state s = {n, r, D, x};
+    residual(s, rhs);
+    for (int i=0; i<n; i++) {
+        if (rhs[i] != 2. - x[i])
+            error("wrong residual from JIT module");
+    }
+}
+
+// layout of the ester_state generated for the model of test_et_warnings
+struct bc_state {
+    int npts;
+    const double *r;
+    const double *D;
+    const double *x;
+    double a;
+};
+
+// the generated code compiles without warnings, including the functions of
+// boundary conditions, which only evaluate derivatives at their point
+void test_et_warnings(const std::string& cache_dir) {
+    const std::string model = "var field: x\n"
+            "var real: a\n"
+            "equation x {\n"
+            "    lap(x) + d(x, r)*x = a\n"
+            "    bc {\n"
+            "        [center]    d(x, r) = 0\n"
+            "        [surface]   x = 1\n"
+            "    }\n"
+            "}\n"
+            "equation a {\n"
+            "    a = x[1]\n"
+            "}\n";
+
+    for (int parallel=0; parallel<2; parallel++) {
+        std::string code = generate(model, parallel);
+        jit j(cache_dir);
+        j.set_flags("-O2 -fopenmp-simd -fno-math-errno -Wall -Wextra -Werror");
+        j.set_parallel(parallel);
+        void *m = j.load(code);
+        if (m == NULL)
+            error("generated code does not compile without warnings");
+        typedef void (*residual_fn)(const bc_state&, double *);
+        auto residual = (residual_fn) dlsym(m, "residual_x");
+        if (residual == NULL)
+            error("residual_x not found in JIT module");
+
+        const int n = 3;
+        double r[n] = {0., .5, 1.}, x[n] = {1., 2., 4.};
+        double D[n*n] = {-3., 4., -1., -1., 0., 1., 1., -4., 3.};
+        double rhs[n];
+        bc_state s = {n, r, D, x, 0.};
+        residual(s, rhs);
+        if (rhs[0] != -(D[0]*x[0] + D[1]*x[1] + D[2]*x[2])
+                || rhs[n-1] != -(x[n-1] - 1))
+            error("wrong boundary conditions from JIT module");
+    }
+}
+
+int main() {
+    char dir[] = "/tmp/test-frontend-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        log::err() << "Could not create a cache directory\n";
+        return EXIT_FAILURE;
+    }
+    int r = EXIT_SUCCESS;
+    try {
+        test_jit(dir);
+        test_et_warnings(dir);
+    }
+    catch (log::fatal_error& e) {
+        log::err() << e.what() << '\n';
+        r = EXIT_FAILURE;
+    }
+    std::system((std::string("rm -rf '") + dir + "'").c_str());
+    return r;
+}
@@ -0,0 +1,84 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstdlib>
+#include <cstdint>
+#include <vector>
+
+namespace ir {
+
+///
+/// \brief Bump allocator releasing all its memory at once
+///
+/// Memory is carved out of large chunks and only given back to the system
+/// when the arena is destroyed. The arena does not run destructors: this is
+/// the job of its owner (see ir::context).
+///
+class arena {
+    public:
+        arena(size_t chunk_size = 64*1024)
+            : cur(NULL), end(NULL), used(0), reserved(0),
+            chunk_size(chunk_size) { }
+        arena(const arena& a) = delete;
+
+        ~arena() {
+            for (auto c: chunks) std::free(c);
+        }
+
+        /// \brief Returns `size' bytes aligned on `align'
+        void *allocate(size_t size, size_t align) {
+            char *p = align_ptr(cur, align);
+            if (cur == NULL || p + size > end) {
+                new_chunk(size + align);
+                p = align_ptr(cur, align);
+            }
+            used += (p - cur) + size;
+            cur = p + size;
+            return p;
+        }
+
+        /// \brief Gives back the memory of the last allocation
+        ///
+        /// Does nothing if `p' is not the last block returned by allocate.
+        void deallocate(void *p, size_t size) {
+            if (static_cast<char *>(p) + size == cur) {
+                cur = static_cast<char *>(p);
+                used -= size;
+            }
+        }
+
+        /// \brief Number of bytes handed out by the arena
+        size_t bytes() const { return used; }
+
+        /// \brief Number of bytes reserved from the system
+        size_t capacity() const { return reserved; }
+
+    private:
+        std::vector<char *> chunks;
+        char *cur;
+        char *end;
+        size_t used;
+        size_t reserved;
+        const size_t chunk_size;
+
+        static char *align_ptr(char *p, size_t align) {
+            uintptr_t a = reinterpret_cast<uintptr_t>(p);
+            return reinterpret_cast<char *>((a + align - 1) & ~(align - 1));
+        }
+
+        void new_chunk(size_t min_size) {
+            size_t size = (min_size > chunk_size) ? min_size : chunk_size;
+            char *c = static_cast<char *>(std::malloc(size));
+            if (c == NULL) {
+                std::abort();
+            }
+            chunks.push_back(c);
+            reserved += size;
+            cur = c;
+            end = c + size;
+        }
+};
+
+} // end namespace ir
+
+#endif
@@ -6,9 +6,9 @@
 
 namespace ir {
 
-    int ast::nodes = 0;
-    const int& ast::n_nodes = ast::nodes;
-    const int& n_nodes = ast::n_nodes;
+    std::atomic<int> ast::nodes(0);
+    const std::atomic<int>& ast::n_nodes = ast::nodes;
+    const std::atomic<int>& n_nodes = ast::n_nodes;
 
     void display_file(const std::string& file) {
 #ifdef HAVE_DOT
@@ -25,40 +25,39 @@ namespace ir {
         std::string tmp(n);
         std::ofstream f;
         f.open(tmp);
-        this->write_dot(f, title, true);
+        this->write_dot(f, title);
         f.close();
         display_file(tmp);
     }
 
-    void ast::write_dot(std::ostream& os,
-            const std::string& title, bool root) const {
-        if (root) {
-            os << "digraph ir {\n";
-            if (title != "") {
-                os << "graph [label=\"" << title <<
-                    "\", labelloc=t, fontsize=20];\n";
-            }
-            os << "node [shape = Mrecord]\n";
+    void ast::write_dot(std::ostream& os, const std::string& title) const {
+        std::set<const ast *> visited;
+        os << "digraph ir {\n";
+        if (title != "") {
+            os << "graph [label=\"" << title <<
+                "\", labelloc=t, fontsize=20];\n";
         }
+        os << "node [shape = Mrecord]\n";
+        this->write_dot_node(os, visited);
+        os << "}\n";
+    }
+
+    // Sub-expressions are shared, each node is written only once
+    void ast::write_dot_node(std::ostream& os,
+            std::set<const ast *>& visited) const {
+        if (!visited.insert(this).second) return;
+
         os << (long) this << " [label=\"";
         os << std::string(*this);
         os << "\"]\n";
 
-        for (auto c: this->children) {
-            os << (long) this << " -> " << (long) c.get() << "\n";
+        for (size_t i=0; i<n_children(); i++) {
+            os << (long) this << " -> " << (long) child(i) << "\n";
         }
 
-        for (auto c: this->children) {
-            c->write_dot(os, title, false);
+        for (size_t i=0; i<n_children(); i++) {
+            child(i)->write_dot_node(os, visited);
         }
-        if (root) {
-            os << "}\n";
-        }
-    }
-
-    void equation::add_bc(std::shared_ptr<const bc> bc) {
-        bcs.push_back(bc);
-        add_child(bc);
     }
 
 }
@@ -0,0 +1,37 @@
+#include "ir.hpp"
+
+namespace ir {
+
+    // each thread builds IR in its own context
+    static thread_local context *current_context = NULL;
+
+    context::context() : previous(current_context) {
+        current_context = this;
+    }
+
+    context::~context() {
+        for (auto it = nodes.rbegin(); it != nodes.rend(); ++it) {
+            (*it)->~ast();
+        }
+        current_context = previous;
+    }
+
+    context& context::current() {
+        if (current_context == NULL) {
+            error("no IR context");
+        }
+        return *current_context;
+    }
+
+    const expr *context::intern(const expr *e) {
+        size_t key = e->hash();
+        auto range = table.equal_range(key);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second->same_node(*e))
+                return it->second;
+        }
+        table.insert(std::make_pair(key, e));
+        return e;
+    }
+
+}
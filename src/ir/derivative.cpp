@@ -0,0 +1,172 @@
+#include "derivative.hpp"
+#include "simplify.hpp"
+#include "tape.hpp"
+
+namespace ir {
+
+static inline expr_ptr zero() { return make<value>(0); }
+
+static inline bool is_zero(expr_ptr e) {
+    auto v = as<value>(*e);
+    return v && v->val == 0;
+}
+
+static inline expr_ptr add(expr_ptr l, expr_ptr r) {
+    return simplify_bin(l, '+', r);
+}
+
+static inline expr_ptr sub(expr_ptr l, expr_ptr r) {
+    return simplify_bin(l, '-', r);
+}
+
+static inline expr_ptr mul(expr_ptr l, expr_ptr r) {
+    return simplify_bin(l, '*', r);
+}
+
+static inline expr_ptr quo(expr_ptr l, expr_ptr r) {
+    return simplify_bin(l, '/', r);
+}
+
+static inline expr_ptr call(const std::string& name, expr_ptr arg) {
+    return make<func>(name, arg);
+}
+
+// operands are differentiated first, in the order of a tape: derive_node
+// finds their derivatives in the cache, so differentiating a long sum does
+// not recurse once per term
+expr_ptr differentiator::derive(const expr& e, symbol var) {
+    auto key = std::make_pair(&e, var);
+    auto it = cache.find(key);
+    if (it != cache.end()) return it->second;
+    tape t;
+    t.record(e);
+    for (tape::index i=0; i<t.size(); i++) {
+        auto k = std::make_pair(t.node(i), var);
+        if (!cache.count(k)) cache[k] = derive_node(*t.node(i), var);
+    }
+    return cache[key];
+}
+
+expr_ptr differentiator::derive_node(const expr& e, symbol var) {
+    switch (e.kind) {
+        case VALUE:
+        case DELTA:
+            return zero();
+        case IDENTIFIER:
+        case FIELD_VALUE: {
+            // the value of a field at a point varies with the field
+            symbol sym = static_cast<const identifier&>(e).sym;
+            if (!is_var(sym)) return zero();
+            if (var == all_vars) return make<delta>(sym);
+            return make<value>(sym == var ? 1 : 0);
+        }
+        case BIN_EXPR: {
+            auto& be = static_cast<const bin_expr&>(e);
+            expr_ptr l = &be.lhs, r = &be.rhs;
+            expr_ptr dl = derive(be.lhs, var);
+            expr_ptr dr = derive(be.rhs, var);
+            switch (be.op) {
+                case '+':
+                    return add(dl, dr);
+                case '-':
+                    return sub(dl, dr);
+                case '*':
+                    return add(mul(dl, r), mul(l, dr));
+                case '/':
+                    // (l/r)' = l'/r - l*r'/r^2
+                    return sub(quo(dl, r),
+                            quo(mul(l, dr), simplify_pow(r, make<value>(2))));
+                default:
+                    error(std::string("Cannot differentiate operator ")
+                            + be.op);
+            }
+        }
+        case UNARY_EXPR: {
+            auto& ue = static_cast<const unary_expr&>(e);
+            if (ue.op != '-')
+                error(std::string("Cannot differentiate operator ") + ue.op);
+            return simplify_neg(derive(ue.expr, var));
+        }
+        case FUNC:
+            return derive_func(static_cast<const func&>(e), var);
+        case LAP_EXPR: {
+            auto& arg = static_cast<const lap_expr&>(e).expr;
+            return derive_operator(e, arg, var);
+        }
+        case DIV_EXPR: {
+            auto& arg = static_cast<const div_expr&>(e).expr;
+            return derive_operator(e, arg, var);
+        }
+        case GRAD_EXPR: {
+            auto& arg = static_cast<const grad_expr&>(e).expr;
+            return derive_operator(e, arg, var);
+        }
+        case DIFF_EXPR: {
+            auto& arg = static_cast<const diff_expr&>(e).expr;
+            return derive_operator(e, arg, var);
+        }
+    }
+    error("Unknown expression kind " + std::to_string(e.kind));
+}
+
+// chain rule: f(a)' = f'(a) * a'
+expr_ptr differentiator::derive_func(const func& f, symbol var) {
+    if (f.name == "pow" && f.args.size() == 2) {
+        expr_ptr a = f.args[0], b = f.args[1];
+        expr_ptr da = derive(*a, var);
+        expr_ptr db = derive(*b, var);
+        // (a^b)' = b*a^(b-1)*a' + a^b*log(a)*b'
+        expr_ptr d = zero();
+        if (!is_zero(da))
+            d = mul(mul(b, simplify_pow(a, sub(b, make<value>(1)))), da);
+        if (!is_zero(db))
+            d = add(d, mul(mul(&f, call("log", a)), db));
+        return d;
+    }
+    if (f.args.size() != 1) {
+        error("Cannot differentiate function " + f.name);
+    }
+
+    expr_ptr a = f.args[0];
+    expr_ptr da = derive(*a, var);
+    if (is_zero(da)) return da;
+    if (f.name == "sin")
+        return mul(call("cos", a), da);
+    if (f.name == "cos")
+        return simplify_neg(mul(call("sin", a), da));
+    if (f.name == "exp")
+        return mul(&f, da);
+    if (f.name == "log")
+        return quo(da, a);
+    if (f.name == "sqrt")
+        return quo(da, mul(make<value>(2), &f));
+    error("Cannot differentiate function " + f.name);
+}
+
+// lap, div, grad and d(., r) are linear operators: their linearization is
+// the operator applied to the linearization of their argument. They are not
+// pointwise functions of a variable though, so they have no partial
+// derivative unless they do not depend on it.
+expr_ptr differentiator::derive_operator(const expr& e, const expr& arg,
+        symbol var) {
+    expr_ptr d = derive(arg, var);
+    if (is_zero(d)) return d;
+    if (var != all_vars) {
+        e.display("Derivative skipped");
+        error("Cannot take the partial derivative of a differential operator");
+    }
+    switch (e.kind) {
+        case LAP_EXPR:
+            return make<lap_expr>(d);
+        case DIV_EXPR:
+            return make<div_expr>(d);
+        case GRAD_EXPR:
+            return make<grad_expr>(d);
+        case DIFF_EXPR:
+            return make<diff_expr>(d, &static_cast<const diff_expr&>(e).id);
+        default:
+            error("Unknown differential operator");
+    }
+}
+
+} // end namespace ir
@@ -0,0 +1,61 @@
+#ifndef DERIVATIVE_H
+#define DERIVATIVE_H
+
+#include "ir.hpp"
+
+#include <functional>
+#include <unordered_map>
+#include <utility>
+
+namespace ir {
+
+///
+/// \brief Symbolic differentiation of expressions
+///
+/// Two kinds of derivatives are computed:
+///  - the functional derivative (linearization) of an expression, where the
+///    variation of a variable `x' is written delta(x),
+///  - the partial derivative of an expression with respect to a variable,
+///    for expressions which are pointwise functions of this variable.
+///
+/// Identifiers for which `is_var' is false (e.g., parameters) are constants.
+/// Results are simplified and memoized per (expression, variable) pair, so
+/// sub-expressions shared in the DAG are differentiated once.
+///
+class differentiator {
+    public:
+        differentiator(std::function<bool (symbol)> is_var)
+            : is_var(is_var) { }
+        differentiator(const differentiator& d) = delete;
+
+        /// \brief Functional derivative of `e'
+        expr_ptr linearize(const expr& e) { return derive(e, all_vars); }
+
+        /// \brief Partial derivative of `e' with respect to variable `var'
+        expr_ptr derivative(const expr& e, symbol var) {
+            return derive(e, var);
+        }
+
+    private:
+        struct key_hash {
+            size_t operator()(const std::pair<expr_ptr, symbol>& k) const {
+                return k.first->hash() ^ (std::hash<symbol>()(k.second) << 1);
+            }
+        };
+
+        // pseudo variable used to linearize with respect to all variables
+        static const symbol all_vars = (symbol) -1;
+
+        std::function<bool (symbol)> is_var;
+        std::unordered_map<std::pair<expr_ptr, symbol>, expr_ptr, key_hash>
+            cache;
+
+        expr_ptr derive(const expr& e, symbol var);
+        expr_ptr derive_node(const expr& e, symbol var);
+        expr_ptr derive_func(const func& f, symbol var);
+        expr_ptr derive_operator(const expr& e, const expr& arg, symbol var);
+};
+
+} // end namespace ir
+
+#endif
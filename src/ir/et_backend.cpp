@@ -0,0 +1,459 @@
+#include "et_backend.hpp"
+#include "visitor.hpp"
+
+#include <cctype>
+
+namespace ir {
+
+// replaces differential operators by identifiers, innermost first
+class et_backend::nonlocal_rewriter : public rewriter {
+    public:
+        nonlocal_rewriter(et_backend& b) : b(b) { }
+
+    protected:
+        virtual expr_ptr visit_lap_expr(const lap_expr& le) {
+            return placeholder(make<lap_expr>(rewrite(le.expr)));
+        }
+
+        virtual expr_ptr visit_diff_expr(const diff_expr& de) {
+            if (de.id.name != "r") TODO;
+            return placeholder(make<diff_expr>(rewrite(de.expr), &de.id));
+        }
+
+        virtual expr_ptr visit_div_expr(const div_expr& de) {
+            de.display("Term skipped");
+            error("div is not supported by the et backend");
+        }
+
+        virtual expr_ptr visit_grad_expr(const grad_expr& ge) {
+            ge.display("Term skipped");
+            error("grad is not supported by the et backend");
+        }
+
+    private:
+        et_backend& b;
+
+        expr_ptr placeholder(expr_ptr term) {
+            auto it = b.term_syms.find(term);
+            if (it != b.term_syms.end()) return make<identifier>(it->second);
+            // `$' cannot appear in identifiers of the language
+            symbol sym = intern("$nl" + std::to_string(b.terms.size()));
+            if (sym >= b.term_index.size())
+                b.term_index.resize(sym + 1, -1);
+            b.term_index[sym] = b.terms.size();
+            b.terms.push_back({sym, term});
+            b.term_syms[term] = sym;
+            return make<identifier>(sym);
+        }
+};
+
+et_backend::et_backend(solver& s) : s(s),
+    der([this](symbol sym) { return this->s.is_var(sym) || is_nonlocal(sym); })
+{ }
+
+void et_backend::emit_code(std::ostream& os) {
+    os << "// generated by ester-lang (expression template backend)\n\n";
+    if (s.parallel)
+        os << "#define ESTER_PARALLEL\n";
+    write_template_file(os, "simd.hpp");
+    write_template_file(os, "et.hpp");
+    emit_state(os);
+    for (auto eq: s.eqs) {
+        if (eq->lhs.has_field_value() || eq->rhs.has_field_value())
+            emit_point_eq(os, *eq);
+        else
+            emit_field_eq(os, *eq);
+    }
+}
+
+void et_backend::emit_state(std::ostream& os) {
+    os << "// values of the variables and parameters, arrays are owned by "
+        "the caller\n";
+    os << "struct ester_state {\n";
+    os << "    int npts;           // number of grid points\n";
+    os << "    const double *r;    // radius of the grid points\n";
+    os << "    const double *D;    // radial derivative matrix, "
+        "npts x npts by rows\n";
+    for (auto v: s.vars) {
+        os << "    " << (v->type == FIELD ? "const double *" : "double ")
+            << v->name << ";\n";
+    }
+    for (auto p: s.params) {
+        os << "    " << (p.second == "double" ? "double " : "const double *")
+            << p.first << ";\n";
+    }
+    os << "};\n\n";
+}
+
+// the state parameter of a function, unnamed if its `body' does not read it
+// (generated code compiles without warnings with -Wextra)
+static std::string state_param(const std::string& body) {
+    for (size_t i = body.find("s."); i != std::string::npos;
+            i = body.find("s.", i + 1)) {
+        if (i == 0 || !(isalnum(body[i-1]) || body[i-1] == '_'))
+            return "const ester_state& s";
+    }
+    return "const ester_state&";
+}
+
+void et_backend::emit_field_eq(std::ostream& os, const equation& eq) {
+    expr_ptr e = replace_nonlocal(*simplify(*(eq.lhs - eq.rhs)));
+    std::vector<expr_ptr> bcs;
+    std::vector<std::pair<expr_ptr, int>> bc_points;
+    for (auto bc: eq.bcs) {
+        bcs.push_back(replace_nonlocal(
+                    *simplify(*(bc->eq.lhs - bc->eq.rhs))));
+        bc_points.push_back(std::make_pair(bcs.back(), bc->bc_loc));
+    }
+
+    os << "// residual of equation " << eq.name << ": rhs = -(lhs - rhs), "
+        "boundary conditions\n// replace its first and last points\n";
+    os << "extern \"C\" ESTER_KERNEL\nvoid residual_" << eq.name
+        << "(const ester_state& s, double *rhs) {\n";
+    // differential operators only used by boundary conditions are evaluated
+    // at their points
+    emit_nonlocal(os, std::vector<expr_ptr>(1, e), bc_points);
+    os << "    et::assign(rhs, s.npts, -(";
+    emit_et(os, *e);
+    os << "));\n";
+    for (size_t j=0; j<bcs.size(); j++) {
+        std::string p = point(eq.bcs[j]->bc_loc);
+        os << "    rhs[" << p << "] = -et::at(";
+        at_loc = eq.bcs[j]->bc_loc;
+        emit_et(os, *bcs[j]);
+        at_loc = -1;
+        os << ", " << p << ");\n";
+    }
+    os << "}\n\n";
+
+    for (auto u: inputs(*e)) {
+        expr_ptr c = der.derivative(*e, u);
+        os << "// coefficient of " << input_desc(u)
+            << " in the linearization of " << eq.name << "\n";
+        os << "extern \"C\" ESTER_KERNEL\nvoid jacobian_" << eq.name << "_"
+            << input_name(u) << "(const ester_state& s, double *c) {\n";
+        emit_nonlocal(os, std::vector<expr_ptr>(1, c));
+        os << "    et::assign(c, s.npts, ";
+        emit_et(os, *c);
+        os << ");\n";
+        os << "}\n\n";
+    }
+
+    for (size_t j=0; j<bcs.size(); j++) {
+        int loc = eq.bcs[j]->bc_loc;
+        for (auto u: inputs(*bcs[j])) {
+            expr_ptr c = der.derivative(*bcs[j], u);
+            os << "// coefficient of " << input_desc(u)
+                << " in boundary condition " << j << " of " << eq.name
+                << "\n";
+            os << "extern \"C\" double jacobian_" << eq.name << "_bc"
+                << j << "_" << input_name(u);
+            emit_point_function(os, *c, loc);
+        }
+    }
+}
+
+// equations on values of fields at a point, which are solved along with the
+// boundary conditions
+void et_backend::emit_point_eq(std::ostream& os, const equation& eq) {
+    expr_ptr e = replace_nonlocal(*simplify(*(eq.lhs - eq.rhs)));
+    int loc = point_of(*e);
+
+    os << "// residual of equation " << eq.name << ": -(lhs - rhs)\n";
+    os << "extern \"C\" double residual_" << eq.name;
+    emit_point_function(os, *e, loc, true);
+
+    for (auto u: inputs(*e)) {
+        expr_ptr c = der.derivative(*e, u);
+        os << "// coefficient of " << input_desc(u)
+            << " in the linearization of " << eq.name << "\n";
+        os << "extern \"C\" double jacobian_" << eq.name << "_"
+            << input_name(u);
+        emit_point_function(os, *c, loc);
+    }
+}
+
+// writes the parameters and the body of a function returning the value of
+// `e' (or -e if `negate') at the point of location `loc'
+void et_backend::emit_point_function(std::ostream& os, const expr& e,
+        int loc, bool negate) {
+    std::ostringstream body;
+    emit_nonlocal(body, std::vector<expr_ptr>(),
+            std::vector<std::pair<expr_ptr, int>>(1, std::make_pair(&e, loc)));
+    body << "    return " << (negate ? "-" : "") << "et::at(";
+    at_loc = loc;
+    emit_et(body, e);
+    at_loc = -1;
+    body << ", " << point(loc) << ");\n";
+    os << "(" << state_param(body.str()) << ") {\n" << body.str() << "}\n\n";
+}
+
+// differential operators directly used by `e'
+std::vector<size_t> et_backend::nonlocal_terms(const expr& e) {
+    std::vector<size_t> ks;
+    tape t;
+    t.record(e);
+    for (tape::index i=0; i<t.size(); i++) {
+        if (t.kind(i) == IDENTIFIER && is_nonlocal(t.sym(i)))
+            ks.push_back(term_index[t.sym(i)]);
+    }
+    return ks;
+}
+
+// writes the arrays of the differential operators used by `exprs', and the
+// values at their point of those only used by `at_points'
+void et_backend::emit_nonlocal(std::ostream& os,
+        const std::vector<expr_ptr>& exprs,
+        const std::vector<std::pair<expr_ptr, int>>& at_points) {
+    full_terms.assign(terms.size(), false);
+    std::vector<std::vector<int>> locs(terms.size());
+    for (auto e: exprs) {
+        for (auto k: nonlocal_terms(*e))
+            full_terms[k] = true;
+    }
+    for (auto& e: at_points) {
+        for (auto k: nonlocal_terms(*e.first)) {
+            auto& l = locs[k];
+            bool known = false;
+            for (auto loc: l)
+                known = known || point(loc) == point(e.second);
+            if (!known) l.push_back(e.second);
+        }
+    }
+    // the argument of a term only refers to terms created before it, which
+    // are needed at all the points
+    for (size_t k=terms.size(); k-- > 0; ) {
+        if (!full_terms[k] && locs[k].empty()) continue;
+        for (auto j: nonlocal_terms(term_arg(k)))
+            full_terms[j] = true;
+    }
+
+    for (size_t k=0; k<terms.size(); k++) {
+        if (!full_terms[k] && locs[k].empty()) continue;
+        bool lap = terms[k].term->kind == LAP_EXPR;
+        const expr& arg = term_arg(k);
+        std::string nl = "nl_" + std::to_string(k);
+        std::string x;
+        auto id = as<identifier>(arg);
+        if (id && is_nonlocal(id->sym)) {
+            x = "&nl_" + std::to_string(term_index[id->sym]) + "[0]";
+        }
+        else if (id && is_field(arg)) {
+            x = "s." + id->name;
+        }
+        else {
+            x = "&arg_" + std::to_string(k) + "[0]";
+            os << "    std::vector<double> arg_" << k << "(s.npts);\n";
+            os << "    et::assign(&arg_" << k << "[0], s.npts, ";
+            emit_et(os, arg);
+            os << ");\n";
+        }
+        if (full_terms[k]) {
+            os << "    std::vector<double> " << nl << "(s.npts);\n";
+            if (lap)
+                os << "    et::lap(s.npts, s.D, s.r, " << x << ", &"
+                    << nl << "[0]);\n";
+            else
+                os << "    et::diff(s.npts, s.D, " << x << ", &"
+                    << nl << "[0]);\n";
+            continue;
+        }
+        for (auto loc: locs[k]) {
+            os << "    double " << nl << "_" << point_name(loc) << " = ";
+            if (lap)
+                os << "et::lap_at(s.npts, s.D, s.r, " << x << ", "
+                    << point(loc) << ");\n";
+            else
+                os << "et::diff_at(s.npts, s.D, " << x << ", "
+                    << point(loc) << ");\n";
+        }
+    }
+}
+
+void et_backend::emit_et(std::ostream& os, const expr& e) {
+    s.write_pieces(os, std::vector<solver::piece>(1, solver::piece(&e)),
+            [this](const expr& t, std::vector<solver::piece>& out) {
+                et_pieces(t, out);
+            });
+}
+
+void et_backend::et_pieces(const expr& e, std::vector<solver::piece>& out) {
+    switch (e.kind) {
+        case VALUE:
+            out.push_back(s.value_text(static_cast<const value&>(e).val));
+            break;
+        case IDENTIFIER: {
+            auto& id = static_cast<const identifier&>(e);
+            if (is_nonlocal(id.sym)) {
+                // evaluated at all the points, or only at the current one
+                size_t k = term_index[id.sym];
+                std::string nl = "nl_" + std::to_string(k);
+                if (full_terms[k])
+                    out.push_back("et::field(&" + nl + "[0])");
+                else if (at_loc >= 0)
+                    out.push_back(nl + "_" + point_name(at_loc));
+                else
+                    error("differential operator not evaluated");
+            }
+            else if (s.is_var(id.sym) || s.is_param(id.sym)) {
+                if (is_field(e))
+                    out.push_back("et::field(s." + id.name + ")");
+                else
+                    out.push_back("s." + id.name);
+            }
+            else {
+                error("Undefined identifier " + id.name);
+            }
+            break;
+        }
+        case FIELD_VALUE: {
+            auto& fv = static_cast<const field_value&>(e);
+            std::string v = "s." + fv.name;
+            if (s.vars[s.var_index[fv.sym]]->type == FIELD)
+                v += "[" + point(point_of(e)) + "]";
+            out.push_back(v);
+            break;
+        }
+        case BIN_EXPR: {
+            auto& be = static_cast<const bin_expr&>(e);
+            bool lp = be.lhs.kind == BIN_EXPR;
+            bool rp = be.rhs.kind == BIN_EXPR || be.rhs.kind == UNARY_EXPR;
+            if (lp) out.push_back(std::string("("));
+            out.push_back(&be.lhs);
+            out.push_back(std::string(lp ? ")" : "") + be.op
+                    + (rp ? "(" : ""));
+            out.push_back(&be.rhs);
+            if (rp) out.push_back(std::string(")"));
+            break;
+        }
+        case UNARY_EXPR: {
+            auto& ue = static_cast<const unary_expr&>(e);
+            bool p = ue.expr.kind == BIN_EXPR || ue.expr.kind == UNARY_EXPR;
+            out.push_back(std::string(1, ue.op) + (p ? "(" : ""));
+            out.push_back(&ue.expr);
+            if (p) out.push_back(std::string(")"));
+            break;
+        }
+        case FUNC: {
+            auto& f = static_cast<const func&>(e);
+            out.push_back(f.name + "(");
+            for (size_t i=0; i<f.args.size(); i++) {
+                if (i > 0) out.push_back(std::string(", "));
+                out.push_back(f.args[i]);
+            }
+            out.push_back(std::string(")"));
+            break;
+        }
+        default:
+            e.display("Term skipped");
+            error("Term skipped");
+    }
+}
+
+bool et_backend::is_field(const expr& e) {
+    // an expression is a field if one of its leaves or operators is (walked
+    // on a tape, sums are deep trees)
+    tape t;
+    t.record(e);
+    for (tape::index i=0; i<t.size(); i++) {
+        switch (t.kind(i)) {
+            case IDENTIFIER: {
+                symbol sym = t.sym(i);
+                if (is_nonlocal(sym)) return true;
+                if (s.is_field_id(sym)) return true;
+                break;
+            }
+            case LAP_EXPR:
+            case DIFF_EXPR:
+            case GRAD_EXPR:
+            case DIV_EXPR:
+                return true;
+            default:
+                break;
+        }
+    }
+    return false;
+}
+
+expr_ptr et_backend::replace_nonlocal(const expr& e) {
+    nonlocal_rewriter r(*this);
+    return r.rewrite(e);
+}
+
+// variables and differential operators `e' depends on
+std::vector<symbol> et_backend::inputs(const expr& e) {
+    std::vector<symbol> syms;
+    tape t;
+    t.record(e);
+    for (tape::index i=0; i<t.size(); i++) {
+        if (t.kind(i) != IDENTIFIER && t.kind(i) != FIELD_VALUE) continue;
+        symbol sym = t.sym(i);
+        if (!s.is_var(sym) && !is_nonlocal(sym)) continue;
+        if (std::find(syms.begin(), syms.end(), sym) == syms.end())
+            syms.push_back(sym);
+    }
+    return syms;
+}
+
+// argument of differential operator `k'
+const expr& et_backend::term_arg(size_t k) {
+    const expr& term = *terms[k].term;
+    return term.kind == LAP_EXPR ?
+        static_cast<const lap_expr&>(term).expr :
+        static_cast<const diff_expr&>(term).expr;
+}
+
+std::string et_backend::input_name(symbol sym) {
+    if (!is_nonlocal(sym)) return name_of(sym);
+    size_t k = term_index[sym];
+    bool lap = terms[k].term->kind == LAP_EXPR;
+    const expr& arg = term_arg(k);
+    if (auto id = as<identifier>(arg)) {
+        if (id->kind == IDENTIFIER)
+            return (lap ? "lap_" : "d_") + input_name(id->sym);
+    }
+    return "nl" + std::to_string(k);
+}
+
+std::string et_backend::input_desc(symbol sym) {
+    if (!is_nonlocal(sym)) return "delta(" + name_of(sym) + ")";
+    size_t k = term_index[sym];
+    bool lap = terms[k].term->kind == LAP_EXPR;
+    const expr& arg = term_arg(k);
+    std::string d = "the variation of its argument";
+    if (auto id = as<identifier>(arg)) {
+        if (id->kind == IDENTIFIER) d = input_desc(id->sym);
+    }
+    return lap ? "lap(" + d + ")" : "d(" + d + ", r)";
+}
+
+// location of the field values in `e'
+int et_backend::point_of(const expr& e) {
+    tape t;
+    t.record(e);
+    for (tape::index i=0; i<t.size(); i++) {
+        if (t.kind(i) != FIELD_VALUE) continue;
+        return s.need_value_at(*t.node(i));
+    }
+    error("No reason to set an equation at a boundary");
+}
+
+std::string et_backend::point(int loc) {
+    switch (loc) {
+        case CENTER:
+        case BOTTOM:
+            return "0";
+        case SURFACE:
+        case TOP:
+            return "s.npts-1";
+        default:
+            error("Unknown BC location " + std::to_string(loc));
+    }
+}
+
+// suffix of the values of differential operators at the point of `loc'
+std::string et_backend::point_name(int loc) {
+    return point(loc) == "0" ? "first" : "last";
+}
+
+} // end namespace ir
@@ -0,0 +1,81 @@
+#ifndef ET_BACKEND_H
+#define ET_BACKEND_H
+
+#include "solver.hpp"
+
+namespace ir {
+
+///
+/// \brief Backend generating self-contained C++ with expression templates
+///
+/// Unlike solver::emit_code, the generated code does not depend on libester:
+/// the values of variables and parameters are passed in an `ester_state'
+/// with the radial derivative matrix, and each equation gets functions
+/// evaluating its residual and the coefficients of its linearization. The
+/// pointwise part of these expressions is written with the expression
+/// templates of templates/et.hpp, so that the compiler evaluates each one
+/// in a single fused loop, vectorized like the kernels of solver::emit_code
+/// (templates/simd.hpp).
+///
+/// Differential operators are evaluated first into arrays, they are the
+/// inputs of the linearization along with the variables: the linearization
+/// of a residual F is the sum over inputs u of dF/du * delta(u). Those only
+/// used by boundary conditions or equations at a point are only evaluated
+/// at that point.
+///
+class et_backend {
+    public:
+        et_backend(solver& s);
+        et_backend(const et_backend& b) = delete;
+
+        void emit_code(std::ostream& os);
+
+    private:
+        // differential operator replaced by the identifier `sym'
+        struct nonlocal {
+            symbol sym;
+            expr_ptr term;  // the operator, applied to the rewritten argument
+        };
+
+        class nonlocal_rewriter;
+
+        solver& s;
+        differentiator der;
+        std::vector<nonlocal> terms;
+        expr_map<symbol> term_syms;
+        std::vector<int> term_index;    // by symbol
+        // terms evaluated at all the points by the function being written,
+        // the others are values at the point of `at_loc'
+        std::vector<bool> full_terms;
+        int at_loc = -1;
+
+        bool is_nonlocal(symbol sym) const {
+            return sym < term_index.size() && term_index[sym] >= 0;
+        }
+        bool is_field(const expr& e);
+        expr_ptr replace_nonlocal(const expr& e);
+        std::vector<size_t> nonlocal_terms(const expr& e);
+        const expr& term_arg(size_t k);
+        std::vector<symbol> inputs(const expr& e);
+        std::string input_name(symbol sym);
+        std::string input_desc(symbol sym);
+        int point_of(const expr& e);
+
+        void emit_state(std::ostream& os);
+        void emit_field_eq(std::ostream& os, const equation& eq);
+        void emit_point_eq(std::ostream& os, const equation& eq);
+        void emit_point_function(std::ostream& os, const expr& e, int loc,
+                bool negate = false);
+        void emit_nonlocal(std::ostream& os,
+                const std::vector<expr_ptr>& exprs,
+                const std::vector<std::pair<expr_ptr, int>>& at_points =
+                    std::vector<std::pair<expr_ptr, int>>());
+        void emit_et(std::ostream& os, const expr& e);
+        void et_pieces(const expr& e, std::vector<solver::piece>& out);
+        static std::string point(int loc);
+        static std::string point_name(int loc);
+};
+
+} // end namespace ir
+
+#endif
@@ -1,36 +1,68 @@
 #include "ir.hpp" 
 
+#include <functional>
+
 namespace ir {
 
+static inline size_t hash_combine(size_t seed, size_t h) {
+    return seed ^ (h + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
 
-// class expr
-bool expr::operator!=(const expr& e) const {
-    return !((*this) == e);
+// Structural hashes only depend on the kind, the payload and the hash of the
+// children of a node, so they are computed in O(1) at construction and are
+// the same from one run to another.
+static inline size_t hash_kind(expr_kind kind) {
+    return std::hash<int>()(kind);
+}
+
+static size_t hash_op(expr_kind kind, char op, const expr& e) {
+    return hash_combine(hash_combine(hash_kind(kind), std::hash<char>()(op)),
+            e.hash());
 }
 
+static size_t hash_unary(expr_kind kind, const expr& e) {
+    return hash_combine(hash_kind(kind), e.hash());
+}
+
+static size_t hash_func(const std::string& name,
+        const std::vector<expr_ptr>& args) {
+    size_t h = hash_combine(hash_kind(FUNC), std::hash<std::string>()(name));
+    for (auto arg: args) {
+        h = hash_combine(h, arg->hash());
+    }
+    return h;
+}
+
+// class expr
 expr::~expr() { }
 
 bool expr::has_field_value() const {
     return false;
 }
 
+bool expr::same_node(const expr& e) const {
+    if (kind != e.kind) return false;
+    if (n_children() != e.n_children()) return false;
+    for (size_t i=0; i<n_children(); i++) {
+        if (child(i) != e.child(i)) return false;
+    }
+    return true;
+}
+
 
 // class value
-value::value(const double& val) : val(val) { }
+value::value(const double& val)
+    : expr(VALUE, hash_combine(hash_kind(VALUE), std::hash<double>()(val))),
+    val(val) { }
 value::~value() { }
 
-std::shared_ptr<const expr> value::copy() const {
-    return std::make_shared<const value>(val);
+bool value::same_node(const expr& e) const {
+    return expr::same_node(e)
+        && val == static_cast<const value&>(e).val;
 }
 
-bool value::operator==(const expr& e) const {
-    try {
-        const ir::value& val = dynamic_cast<const value&>(e);
-        return this->val == val.val;
-    }
-    catch (const std::bad_cast& e) {
-        return false;
-    }
+bool value::equals(const expr& e) const {
+    return val == static_cast<const value&>(e).val;
 }
 
 value::operator std::string() const {
@@ -42,59 +74,47 @@ bool value::has_field_value() const {
 }
 
 // class identifier
-identifier::identifier(const std::string& name) : name(name) { }
+identifier::identifier(symbol sym)
+    : identifier(IDENTIFIER, sym) { }
+identifier::identifier(const std::string& name)
+    : identifier(IDENTIFIER, intern(name)) { }
+identifier::identifier(expr_kind kind, symbol sym, size_t seed)
+    : expr(kind, hash_combine(hash_combine(hash_kind(kind),
+                    std::hash<symbol>()(sym)), seed)),
+    sym(sym), name(name_of(sym)) { }
 identifier::~identifier() { }
 
-std::shared_ptr<const expr> identifier::copy() const {
-    return std::make_shared<const identifier>(name);
+bool identifier::same_node(const expr& e) const {
+    return expr::same_node(e)
+        && sym == static_cast<const identifier&>(e).sym;
 }
 
-bool identifier::operator==(const expr& e) const {
-    try {
-        const ir::identifier& id = dynamic_cast<const identifier&>(e);
-        return name == id.name;
-    }
-    catch (const std::bad_cast& e) {
-        return false;
-    }
+bool identifier::equals(const expr& e) const {
+    return sym == static_cast<const identifier&>(e).sym;
 }
 identifier::operator std::string() const {
     return std::string("ID: ") + name;
 }
 
 // class delta
-delta::delta(const std::string& name) : identifier(name) { }
-delta::delta(const delta& d) : delta(d.name) { }
+delta::delta(symbol sym) : identifier(DELTA, sym) { }
+delta::delta(const std::string& name) : identifier(DELTA, intern(name)) { }
 delta::~delta() { }
-std::shared_ptr<const expr> delta::copy() const {
-    return std::make_shared<const delta>(*this);
-}
 
 delta::operator std::string() const {
     return std::string("delta: ") + name;
 }
 
 // class field_value
-field_value::field_value(const std::string& name,
-        std::shared_ptr<const expr> index) : identifier(name), index(*index) {
-    add_child(index);
-}
-field_value::field_value(const field_value& fv)
-    : field_value(fv.name, fv.index.copy()) { }
-
-std::shared_ptr<const expr> field_value::copy() const {
-    return std::make_shared<const field_value>(*this);
-}
+field_value::field_value(symbol sym, expr_ptr index)
+    : identifier(FIELD_VALUE, sym, index->hash()), index(*index) { }
+field_value::field_value(const std::string& name, expr_ptr index)
+    : field_value(intern(name), index) { }
 field_value::~field_value() {}
 
-bool field_value::operator==(const expr& e) const {
-    try {
-        const ir::field_value& fv = dynamic_cast<const field_value&>(e);
-        return name == fv.name && index == fv.index;
-    }
-    catch (const std::bad_cast& e) {
-        return false;
-    }
+bool field_value::equals(const expr& e) const {
+    auto& fv = static_cast<const field_value&>(e);
+    return sym == fv.sym && index == fv.index;
 }
 
 field_value::operator std::string() const {
@@ -106,66 +126,49 @@ bool field_value::has_field_value() const {
 }
 
 // class bin_expr{
-bin_expr::bin_expr(std::shared_ptr<const expr> l,
-        char op, std::shared_ptr<const expr> r)
-    : lhs(*l), rhs(*r), op(op), precedence(op_prec(op)) {
-
-    add_child(l);
-    add_child(r);
-}
-
-bin_expr::bin_expr(const bin_expr& be)
-    : bin_expr(be.lhs.copy(), be.op, be.rhs.copy()) { }
+bin_expr::bin_expr(expr_ptr l, char op, expr_ptr r)
+    : expr(BIN_EXPR, hash_combine(hash_op(BIN_EXPR, op, *l), r->hash())),
+    lhs(*l), rhs(*r), op(op), precedence(op_prec(op)),
+    field_values(l->has_field_value() || r->has_field_value()) { }
 
 bin_expr::~bin_expr() { }
 
-std::shared_ptr<const expr> bin_expr::copy() const {
-    return std::make_shared<const bin_expr>(*this);
+bool bin_expr::same_node(const expr& e) const {
+    return expr::same_node(e)
+        && op == static_cast<const bin_expr&>(e).op;
 }
 
-bool bin_expr::operator==(const expr& e) const {
-    try {
-        const ir::bin_expr& be = dynamic_cast<const bin_expr&>(e);
-        return op == be.op
-            && lhs == be.lhs
-            && rhs == be.rhs;
-    }
-    catch (const std::bad_cast& e) {
-        return false;
-    }
+bool bin_expr::equals(const expr& e) const {
+    auto& be = static_cast<const bin_expr&>(e);
+    return op == be.op
+        && lhs == be.lhs
+        && rhs == be.rhs;
 }
 bin_expr::operator std::string() const {
     return std::string("BE: ") + op;
 }
 
 bool bin_expr::has_field_value() const {
-    return lhs.has_field_value() || rhs.has_field_value();
+    return field_values;
 }
 
 // class unary_expr
-unary_expr::unary_expr(char op, std::shared_ptr<const class expr> e)
-    : expr(*e), op(op), precedence(op_prec(op)) {
-
-    add_child(e);
-}
-
-unary_expr::unary_expr(const unary_expr& ue) : unary_expr(ue.op, ue.expr.copy()) { }
+unary_expr::unary_expr(char op, expr_ptr e)
+    : ir::expr(UNARY_EXPR, hash_op(UNARY_EXPR, op, *e)),
+    expr(*e), op(op), precedence(op_prec(op)),
+    field_values(e->has_field_value()) { }
 
 unary_expr::~unary_expr() { }
 
-std::shared_ptr<const expr> unary_expr::copy() const {
-    return std::make_shared<const unary_expr>(*this);
+bool unary_expr::same_node(const class expr& e) const {
+    return ir::expr::same_node(e)
+        && op == static_cast<const unary_expr&>(e).op;
 }
 
-bool unary_expr::operator==(const class expr& e) const {
-    try {
-        const ir::unary_expr& ue = dynamic_cast<const unary_expr&>(e);
-        return op == ue.op
-            && expr == ue.expr;
-    }
-    catch (const std::bad_cast& e) {
-        return false;
-    }
+bool unary_expr::equals(const class expr& e) const {
+    auto& ue = static_cast<const unary_expr&>(e);
+    return op == ue.op
+        && expr == ue.expr;
 }
 
 unary_expr::operator std::string() const {
@@ -173,52 +176,33 @@ unary_expr::operator std::string() const {
 }
 
 bool unary_expr::has_field_value() const {
-    return expr.has_field_value();
+    return field_values;
 }
 
 // class func
-func::func(const std::string& name) : name(name) { }
-
-func::func(const std::string& name, std::shared_ptr<const expr> e) : name(name) {
-    add_child(e);
-    args.push_back(e);
-}
+func::func(const std::string& name)
+    : func(name, std::vector<expr_ptr>()) { }
 
-func::func(const std::string& name,
-        std::vector<std::shared_ptr<const expr>> args) : name(name) {
-    for (auto arg: args) {
-        add_child(arg);
-        this->args.push_back(arg);
-    }
-}
+func::func(const std::string& name, expr_ptr e)
+    : func(name, std::vector<expr_ptr>(1, e)) { }
 
-func::func(const func& f) : func(f.name) {
-    for (auto arg: f.args) {
-        std::shared_ptr<const expr> arg_cpy = arg->copy();
-        add_child(arg_cpy);
-        args.push_back(arg_cpy);
-    }
-}
+func::func(const std::string& name, std::vector<expr_ptr> args)
+    : expr(FUNC, hash_func(name, args)), name(name), args(args) { }
 
-std::shared_ptr<const expr> func::copy() const {
-    return std::make_shared<const func>(*this);
+bool func::same_node(const class expr& e) const {
+    return expr::same_node(e)
+        && name == static_cast<const func&>(e).name;
 }
 
-bool func::operator==(const class expr& e) const {
-    bool same_args = true;
+bool func::equals(const class expr& e) const {
+    auto& f = static_cast<const func&>(e);
+    if (f.name != name) return false;
+    if (f.args.size() != args.size()) return false;
 
-    try {
-        const ir::func& f = dynamic_cast<const func&>(e);
-        if (f.args.size() != args.size()) return false;
-
-        for (size_t i=0; i<args.size(); i++) {
-            same_args  = same_args || (f.args[i] == args[i]);
-        }
-        return same_args && f.name == name;
-    }
-    catch (const std::bad_cast& e) {
-        return false;
+    for (size_t i=0; i<args.size(); i++) {
+        if (*f.args[i] != *args[i]) return false;
     }
+    return true;
 }
 
 func::~func() { }
@@ -229,12 +213,9 @@ func::operator std::string() const {
 
 
 // class div_expr
-div_expr::div_expr(std::shared_ptr<const class expr> e) : expr(*e) {
-    add_child(e);
-}
+div_expr::div_expr(expr_ptr e)
+    : ir::expr(DIV_EXPR, hash_unary(DIV_EXPR, *e)), expr(*e) { }
 
-div_expr::div_expr(const div_expr& de) : div_expr(de.expr.copy()) {
-}
 
 div_expr:: ~div_expr() { }
 
@@ -242,20 +223,14 @@ div_expr::operator std::string() const {
     return std::string("DIV: ");
 }
 
-bool div_expr::operator==(const class expr& e) const {
-    TODO;
-}
-
-std::shared_ptr<const expr> div_expr::copy() const {
-    return std::make_shared<const div_expr>(*this);
+bool div_expr::equals(const class expr& e) const {
+    return expr == static_cast<const div_expr&>(e).expr;
 }
 
 // class grad_expr
-grad_expr::grad_expr(std::shared_ptr<const class expr> e) : expr(*e) {
-    add_child(e);
-}
+grad_expr::grad_expr(expr_ptr e)
+    : ir::expr(GRAD_EXPR, hash_unary(GRAD_EXPR, *e)), expr(*e) { }
 
-grad_expr::grad_expr(const grad_expr& ge) : grad_expr(ge.expr.copy()) { }
 
 grad_expr::~grad_expr() { }
 
@@ -263,21 +238,15 @@ grad_expr::operator std::string() const {
     return std::string("GRAD: ");
 }
 
-bool grad_expr::operator==(const class expr& e) const {
-    TODO;
-}
-
-std::shared_ptr<const expr> grad_expr::copy() const {
-    return std::make_shared<const grad_expr>(*this);
+bool grad_expr::equals(const class expr& e) const {
+    return expr == static_cast<const grad_expr&>(e).expr;
 }
 
 
 // class lap_expr
-lap_expr::lap_expr(std::shared_ptr<const class expr> e) : expr(*e) {
-    add_child(e);
-}
+lap_expr::lap_expr(expr_ptr e)
+    : ir::expr(LAP_EXPR, hash_unary(LAP_EXPR, *e)), expr(*e) { }
 
-lap_expr::lap_expr(const lap_expr& le) : lap_expr(le.expr.copy()) { }
 
 lap_expr::~lap_expr() { }
 
@@ -285,24 +254,15 @@ lap_expr::operator std::string() const {
     return std::string("LAP: ");
 }
 
-bool lap_expr::operator==(const class expr& e) const {
-    TODO;
-}
-
-std::shared_ptr<const expr> lap_expr::copy() const {
-    return std::make_shared<const lap_expr>(*this);
+bool lap_expr::equals(const class expr& e) const {
+    return expr == static_cast<const lap_expr&>(e).expr;
 }
 
 
 // class diff_expr
-diff_expr::diff_expr(std::shared_ptr<const class expr> e,
-        std::shared_ptr<const identifier> id) : expr(*e), id(*id) {
-    add_child(e);
-    add_child(id);
-}
-
-diff_expr::diff_expr(const diff_expr& de) : diff_expr(de.expr.copy(),
-        std::make_shared<const identifier>(de.id.name)) { }
+diff_expr::diff_expr(expr_ptr e, const identifier *id)
+    : ir::expr(DIFF_EXPR, hash_combine(hash_unary(DIFF_EXPR, *e), id->hash())),
+    expr(*e), id(*id) { }
 
 diff_expr::~diff_expr() { }
 
@@ -310,29 +270,21 @@ diff_expr::operator std::string() const {
     return std::string("DIFF: ");
 }
 
-bool diff_expr::operator==(const class expr& e) const {
-    try {
-        const ir::diff_expr& de = dynamic_cast<const diff_expr&>(e);
-        return this->expr == de.expr
-            && this->id == de.id;
-    }
-    catch (const std::bad_cast& e) {
-        return false;
-    }
-}
-
-std::shared_ptr<const expr> diff_expr::copy() const {
-    return std::make_shared<const diff_expr>(*this);
+bool diff_expr::equals(const class expr& e) const {
+    auto& de = static_cast<const diff_expr&>(e);
+    return this->expr == de.expr
+        && this->id == de.id;
 }
 
 // class equation
-equation::equation(const std::string name,
-        std::shared_ptr<const expr> lhs,
-        std::shared_ptr<const expr> rhs)
-    : name(name), lhs(*lhs), rhs(*rhs) {
+equation::equation(const std::string name, expr_ptr lhs, expr_ptr rhs,
+        const std::vector<const bc *>& bcs)
+    : name(name), lhs(*lhs), rhs(*rhs), bcs(bcs) { }
 
-    add_child(lhs);
-    add_child(rhs);
+const ast *equation::child(size_t i) const {
+    if (i == 0) return &lhs;
+    if (i == 1) return &rhs;
+    return bcs[i-2];
 }
 
 equation::operator std::string() const {
@@ -340,11 +292,8 @@ equation::operator std::string() const {
 }
 
 // class bc
-bc::bc(std::shared_ptr<const equation> cond, const int& loc)
-    : eq(*cond), bc_loc(loc) {
-
-    add_child(cond);
-}
+bc::bc(const equation *cond, const int& loc)
+    : eq(*cond), bc_loc(loc) { }
 
 bc::operator std::string() const {
     switch (bc_loc) {
@@ -362,53 +311,52 @@ bc::operator std::string() const {
 }
 
 
-func sin(const expr& e) {
-    return func("sin", e.copy());
+expr_ptr sin(const expr& e) {
+    return make<func>("sin", e.ptr());
 }
 
-func cos(const expr& e) {
-    return func("cos", e.copy());
+expr_ptr cos(const expr& e) {
+    return make<func>("cos", e.ptr());
 }
 
-div_expr div(const expr& e) {
-    return div_expr(e.copy());
+expr_ptr div(const expr& e) {
+    return make<div_expr>(e.ptr());
 }
 
-grad_expr grad(const expr& e) {
-    return grad_expr(e.copy());
+expr_ptr grad(const expr& e) {
+    return make<grad_expr>(e.ptr());
 }
 
-lap_expr lap(const expr& e) {
-    return lap_expr(e.copy());
+expr_ptr lap(const expr& e) {
+    return make<lap_expr>(e.ptr());
 }
 
-func pow(const expr& e, int p) {
-    std::vector<std::shared_ptr<const expr>> args;
-    args.push_back(e.copy());
-    args.push_back(std::make_shared<const value>((double) p));
-    return ir::func("pow", args);
+expr_ptr pow(const expr& e, int p) {
+    std::vector<expr_ptr> args;
+    args.push_back(e.ptr());
+    args.push_back(make<value>((double) p));
+    return make<func>("pow", args);
 }
 
 
 } // end name ir
 
-ir::bin_expr operator+(const ir::expr& l, const ir::expr& r) {
-    return ir::bin_expr(l.copy(), '+', r.copy());
+ir::expr_ptr operator+(const ir::expr& l, const ir::expr& r) {
+    return ir::make<ir::bin_expr>(l.ptr(), '+', r.ptr());
 }
 
-ir::bin_expr operator*(const ir::expr& l, const ir::expr& r) {
-    return ir::bin_expr(l.copy(), '*', r.copy());
+ir::expr_ptr operator*(const ir::expr& l, const ir::expr& r) {
+    return ir::make<ir::bin_expr>(l.ptr(), '*', r.ptr());
 }
 
-ir::bin_expr operator-(const ir::expr& l, const ir::expr& r) {
-    return ir::bin_expr(l.copy(), '-', r.copy());
+ir::expr_ptr operator-(const ir::expr& l, const ir::expr& r) {
+    return ir::make<ir::bin_expr>(l.ptr(), '-', r.ptr());
 }
 
-ir::bin_expr operator/(const ir::expr& l, const ir::expr& r) {
-    return ir::bin_expr(l.copy(), '/', r.copy());
+ir::expr_ptr operator/(const ir::expr& l, const ir::expr& r) {
+    return ir::make<ir::bin_expr>(l.ptr(), '/', r.ptr());
 }
 
-ir::unary_expr operator-(const ir::expr& e) {
-    return ir::unary_expr('-', e.copy());
+ir::expr_ptr operator-(const ir::expr& e) {
+    return ir::make<ir::unary_expr>('-', e.ptr());
 }
-
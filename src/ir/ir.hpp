@@ -2,10 +2,16 @@
 #define IR_H
 
 #include "log.hpp"
+#include "arena.hpp"
+#include "symbols.hpp"
 
+#include <atomic>
 #include <string>
 #include <vector>
-#include <memory>
+#include <set>
+#include <unordered_map>
+#include <type_traits>
+#include <utility>
 
 
 #define TODO    error("not yet implemented");
@@ -17,6 +23,9 @@ namespace ir {
 ///
 /// All nodes of an AST should derive from this class.
 ///
+/// Nodes are allocated in the arena of an ir::context (see ir::make) and live
+/// as long as this context.
+///
 class ast {
 
     public:
@@ -28,7 +37,7 @@ class ast {
         virtual ~ast() { nodes--; }
 
         /// \brief Holds the number of currently allocated nodes
-        static const int& n_nodes;
+        static const std::atomic<int>& n_nodes;
 
         /// \brief Display the AST using GraphViz's dot program
         void display(std::string = "") const;
@@ -36,34 +45,187 @@ class ast {
         /// \brief Casting to string operator
         virtual operator std::string() const = 0;
 
-    protected:
-        void add_child(std::shared_ptr<const ast> node) {
-            children.push_back(node);
+        /// \brief Number of children of the node
+        virtual size_t n_children() const { return 0; }
+
+        /// \brief Returns the i-th child of the node
+        virtual const ast *child(size_t) const { return NULL; }
+
+    private:
+        static std::atomic<int> nodes;
+        void write_dot(std::ostream& os, const std::string& title) const;
+        void write_dot_node(std::ostream& os,
+                std::set<const ast *>& visited) const;
+};
+
+extern const std::atomic<int>& n_nodes;
+
+class expr;
+typedef const expr *expr_ptr;
+
+/// \brief Kind of an expression node, used to dispatch on expressions
+/// without RTTI (see ir::as and ir::visitor)
+typedef enum expr_kind {
+    VALUE,
+    IDENTIFIER,
+    DELTA,
+    FIELD_VALUE,
+    BIN_EXPR,
+    UNARY_EXPR,
+    FUNC,
+    DIV_EXPR,
+    GRAD_EXPR,
+    LAP_EXPR,
+    DIFF_EXPR,
+} expr_kind;
+
+///
+/// \brief Owns the nodes of a compilation unit
+///
+/// All nodes are allocated in the arena of the context and released at once
+/// when the context is destroyed. Expressions are immutable and hash-consed:
+/// two structurally identical expressions built in the same context are the
+/// same node, so sub-expressions are shared instead of copied.
+///
+/// Creating a context makes it the current one (used by ir::make) until it is
+/// destroyed. The current context is per thread: threads building separate
+/// models do not share IR.
+///
+/// The context also holds the symbol table in which the names of identifiers
+/// are interned: symbols are only meaningful within their context.
+///
+class context {
+    public:
+        context();
+        context(const context& c) = delete;
+        ~context();
+
+        /// \brief Returns the current context
+        static context& current();
+
+        /// \brief Builds a node of type T in the arena
+        ///
+        /// If T is an expression, returns the existing node structurally
+        /// equal to T(args...) if there is one.
+        template <class T, class... Args>
+        const T *make(Args&&... args) {
+            void *mem = pool.allocate(sizeof(T), alignof(T));
+            T *node = new (mem) T(std::forward<Args>(args)...);
+            return add(node, std::is_base_of<expr, T>());
         }
 
+        /// \brief Number of nodes allocated in the context
+        size_t n_nodes() const { return nodes.size(); }
+
+        /// \brief Number of bytes used by the nodes of the context
+        size_t bytes() const { return pool.bytes(); }
+
+        symbol_table& symbols() { return syms; }
+        const symbol_table& symbols() const { return syms; }
+
     private:
-        static int nodes;
-        std::vector<std::shared_ptr<const ast>> children;
-        void write_dot(
-                std::ostream& os,
-                const std::string& title,
-                bool root = true) const;
-
-        friend class solver;
+        arena pool;
+        symbol_table syms;
+        std::vector<const ast *> nodes;
+        std::unordered_multimap<size_t, const expr *> table;
+        context *previous;
+
+        const expr *intern(const expr *e);
+
+        template <class T>
+        const T *add(T *node, std::false_type) {
+            nodes.push_back(node);
+            return node;
+        }
+
+        template <class T>
+        const T *add(T *node, std::true_type) {
+            const expr *e = intern(node);
+            if (e != node) {
+                node->~T();
+                pool.deallocate(node, sizeof(T));
+                return static_cast<const T *>(e);
+            }
+            nodes.push_back(node);
+            return node;
+        }
 };
 
-extern const int& n_nodes;
+/// \brief Builds (or reuses) the node T(args...) in the current context
+template <class T, class... Args>
+const T *make(Args&&... args) {
+    return context::current().make<T>(std::forward<Args>(args)...);
+}
+
+/// \brief Interns `name' in the symbol table of the current context
+inline symbol intern(const std::string& name) {
+    return context::current().symbols().intern(name);
+}
+
+/// \brief Name of symbol `s' in the current context
+inline const std::string& name_of(symbol s) {
+    return context::current().symbols().name(s);
+}
 
 /// \brief Pure virtual class representing mathematical expressions
+///
+/// Expressions should only be created with ir::make (or the operators and
+/// functions below).
 class expr : public ast {
     public:
-        virtual std::shared_ptr<const expr> copy() const = 0;
-        virtual bool operator==(const expr&) const = 0;
-        virtual bool operator!=(const expr& e) const;
+        expr(expr_kind kind, size_t hash) : kind(kind), h(hash) { }
+
+        /// \brief Structural equality
+        ///
+        /// Identical nodes are equal and nodes with different hashes are
+        /// not, so deep comparisons only happen on hash collisions or between
+        /// expressions from different contexts.
+        bool operator==(const expr& e) const {
+            return this == &e || (h == e.h && kind == e.kind && equals(e));
+        }
+        bool operator!=(const expr& e) const { return !(*this == e); }
+
         virtual ~expr();
         virtual bool has_field_value() const ;
+
+        /// \brief Returns a pointer to this expression
+        expr_ptr ptr() const { return this; }
+
+        const expr_kind kind;
+
+        /// \brief Structural hash of the expression, computed at construction
+        size_t hash() const { return h; }
+
+    protected:
+        /// \brief Deep structural comparison with an expression of same kind
+        /// and same hash
+        virtual bool equals(const expr& e) const = 0;
+
+        /// \brief Shallow comparison used when interning nodes: compares the
+        /// payload of the nodes and the address of their (interned) children
+        virtual bool same_node(const expr& e) const;
+
+        friend class context;
+
+    private:
+        const size_t h;
+};
+
+/// \brief Hash functor for expression pointers, hashing the expression
+struct expr_hash {
+    size_t operator()(expr_ptr e) const { return e->hash(); }
 };
 
+/// \brief Equality functor for expression pointers, comparing the
+/// expressions
+struct expr_equal {
+    bool operator()(expr_ptr a, expr_ptr b) const { return *a == *b; }
+};
+
+/// \brief Hash map indexed by expressions (compared structurally)
+template <class T>
+using expr_map = std::unordered_map<expr_ptr, T, expr_hash, expr_equal>;
+
 /// \brief Class used to represent numerical values
 class value : public expr {
     public:
@@ -71,10 +233,14 @@ class value : public expr {
         virtual ~value();
         const double val;
 
-        virtual std::shared_ptr<const expr> copy() const;
-        virtual bool operator==(const expr& e) const;
+        static bool classof(const expr& e) { return e.kind == VALUE; }
+
         virtual operator std::string() const;
         virtual bool has_field_value() const ;
+
+    protected:
+        virtual bool equals(const expr& e) const;
+        virtual bool same_node(const expr& e) const;
 };
 
 typedef enum var_type {
@@ -85,23 +251,40 @@ typedef enum var_type {
 /// \brief Class used to represent identifiers (e.g., variables)
 class identifier : public expr {
     public:
+        identifier(symbol sym);
         identifier(const std::string& name);
         virtual ~identifier();
-        virtual std::shared_ptr<const expr> copy() const;
-        virtual bool operator==(const expr& e) const;
         virtual operator std::string() const;
 
-        const std::string name;
+        /// \brief Interned name of the identifier
+        const symbol sym;
+        /// \brief Name of the identifier (owned by the symbol table)
+        const std::string& name;
+
+        static bool classof(const expr& e) {
+            return e.kind == IDENTIFIER
+                || e.kind == DELTA
+                || e.kind == FIELD_VALUE;
+        }
+
+    protected:
+        /// `seed' is combined to the hash of the name by derived classes
+        /// holding more than a name
+        identifier(expr_kind kind, symbol sym, size_t seed = 0);
+
+        virtual bool equals(const expr& e) const;
+        virtual bool same_node(const expr& e) const;
 };
 
 
 /// \brief Used to represent functional derivatives
 class delta : public identifier {
     public:
+        delta(symbol sym);
         delta(const std::string& name);
-        delta(const delta& d);
         virtual ~delta();
-        virtual std::shared_ptr<const expr> copy() const;
+
+        static bool classof(const expr& e) { return e.kind == DELTA; }
 
         virtual operator std::string() const;
 };
@@ -109,17 +292,23 @@ class delta : public identifier {
 /// \brief Used to represent value of a field at a particular point
 class field_value : public identifier {
     public:
-        field_value(const std::string& name, std::shared_ptr<const expr> index);
-        field_value(const field_value& fv);
-        virtual std::shared_ptr<const expr> copy() const;
+        field_value(symbol sym, expr_ptr index);
+        field_value(const std::string& name, expr_ptr index);
         virtual ~field_value();
 
-        virtual bool operator==(const expr& e) const;
         virtual operator std::string() const;
 
         const expr& index;
 
         bool has_field_value() const;
+
+        virtual size_t n_children() const { return 1; }
+        virtual const ast *child(size_t) const { return &index; }
+
+        static bool classof(const expr& e) { return e.kind == FIELD_VALUE; }
+
+    protected:
+        virtual bool equals(const expr& e) const;
 };
 
 inline int op_prec(const char c) {
@@ -131,8 +320,8 @@ inline int op_prec(const char c) {
         case '/':
             return 2;
         default:
-            log::err() << "unknown operator precedence for operator " << c;
-            std::exit(EXIT_FAILURE);
+            error(std::string("unknown operator precedence for operator ")
+                    + c);
     }
 }
 
@@ -140,119 +329,172 @@ inline int op_prec(const char c) {
 /// (e.g, additions, multiplications)
 class bin_expr : public expr {
     public:
-        bin_expr(std::shared_ptr<const expr> l,
-                char op,
-                std::shared_ptr<const expr> r);
-        bin_expr(const bin_expr& be);
+        bin_expr(expr_ptr l, char op, expr_ptr r);
         virtual ~bin_expr() ;
-        virtual std::shared_ptr<const expr> copy() const ;
-        virtual bool operator==(const expr& e) const ;
         virtual operator std::string() const ;
 
         virtual bool has_field_value() const ;
 
+    protected:
+        virtual bool equals(const expr& e) const;
+        virtual bool same_node(const expr& e) const;
+
     public:
         const expr& lhs;
         const expr& rhs;
         const char op;
 
         const int precedence;
+
+        virtual size_t n_children() const { return 2; }
+        virtual const ast *child(size_t i) const {
+            return (i == 0) ? &lhs : &rhs;
+        }
+
+        static bool classof(const expr& e) { return e.kind == BIN_EXPR; }
+
+    private:
+        // computed at construction, like the hash: long sums are not walked
+        const bool field_values;
 };
 
 class unary_expr : public expr {
     public:
-        unary_expr(char op, std::shared_ptr<const expr> e);
-        unary_expr(const unary_expr& ue);
+        unary_expr(char op, expr_ptr e);
         virtual ~unary_expr();
-        virtual std::shared_ptr<const expr> copy() const;
-        virtual bool operator==(const expr& e) const;
         virtual operator std::string() const;
 
         virtual bool has_field_value() const;
 
+    protected:
+        virtual bool equals(const expr& e) const;
+        virtual bool same_node(const expr& e) const;
+
     public:
         const expr& expr;
         const char op;
         const int precedence;
+
+        virtual size_t n_children() const { return 1; }
+        virtual const ast *child(size_t) const { return &expr; }
+
+        static bool classof(const class expr& e) {
+            return e.kind == UNARY_EXPR;
+        }
+
+    private:
+        const bool field_values;
 };
 
 class func : public expr {
     public:
         func(const std::string& name);
 
-        func(const std::string& name, std::shared_ptr<const expr> e);
+        func(const std::string& name, expr_ptr e);
 
-        func(const std::string& name,
-                std::vector<std::shared_ptr<const expr>> args);
+        func(const std::string& name, std::vector<expr_ptr> args);
 
-        func(const func& f);
-
-        virtual std::shared_ptr<const expr> copy() const;
-        virtual bool operator==(const expr& e) const;
         virtual ~func();
         virtual operator std::string() const;
 
         const std::string name;
-        std::vector<std::shared_ptr<const expr>> args;
+        std::vector<expr_ptr> args;
+
+        virtual size_t n_children() const { return args.size(); }
+        virtual const ast *child(size_t i) const { return args[i]; }
+
+        static bool classof(const expr& e) { return e.kind == FUNC; }
+
+    protected:
+        virtual bool equals(const expr& e) const;
+        virtual bool same_node(const expr& e) const;
 
 };
 
 class div_expr : public expr {
     public:
-        div_expr(std::shared_ptr<const expr> e);
-        div_expr(const div_expr& de);
+        div_expr(expr_ptr e);
         virtual ~div_expr();
         virtual operator std::string() const;
-        virtual bool operator==(const expr& e) const;
-        virtual std::shared_ptr<const expr> copy() const;
 
         const expr& expr;
+
+        virtual size_t n_children() const { return 1; }
+        virtual const ast *child(size_t) const { return &expr; }
+
+        static bool classof(const class expr& e) {
+            return e.kind == DIV_EXPR;
+        }
+
+    protected:
+        virtual bool equals(const class expr& e) const;
 };
 
 class grad_expr : public expr {
     public:
-        grad_expr(std::shared_ptr<const expr> e);
-        grad_expr(const grad_expr& ge);
+        grad_expr(expr_ptr e);
         virtual ~grad_expr();
         virtual operator std::string() const;
-        virtual bool operator==(const expr& e) const;
-        virtual std::shared_ptr<const expr> copy() const;
 
         const expr& expr;
+
+        virtual size_t n_children() const { return 1; }
+        virtual const ast *child(size_t) const { return &expr; }
+
+        static bool classof(const class expr& e) {
+            return e.kind == GRAD_EXPR;
+        }
+
+    protected:
+        virtual bool equals(const class expr& e) const;
 };
 
 class lap_expr : public expr {
     public:
-        lap_expr(std::shared_ptr<const expr> e);
-        lap_expr(const lap_expr& le);
+        lap_expr(expr_ptr e);
         virtual ~lap_expr();
         virtual operator std::string() const;
-        virtual bool operator==(const expr& e) const;
-        virtual std::shared_ptr<const expr> copy() const;
 
         const expr& expr;
+
+        virtual size_t n_children() const { return 1; }
+        virtual const ast *child(size_t) const { return &expr; }
+
+        static bool classof(const class expr& e) {
+            return e.kind == LAP_EXPR;
+        }
+
+    protected:
+        virtual bool equals(const class expr& e) const;
 };
 
 class diff_expr : public expr {
     public:
-        diff_expr(std::shared_ptr<const expr> e,
-                std::shared_ptr<const identifier> id);
-        diff_expr(const diff_expr& de);
+        diff_expr(expr_ptr e, const identifier *id);
         virtual ~diff_expr();
         virtual operator std::string() const;
-        virtual bool operator==(const expr& e) const;
-        virtual std::shared_ptr<const expr> copy() const;
 
         const expr& expr;
         const identifier& id;
+
+        virtual size_t n_children() const { return 2; }
+        virtual const ast *child(size_t i) const {
+            return (i == 0) ? &expr : static_cast<const ast *>(&id);
+        }
+
+        static bool classof(const class expr& e) {
+            return e.kind == DIFF_EXPR;
+        }
+
+    protected:
+        virtual bool equals(const class expr& e) const;
 };
 
 class bc;
 class equation : public ast {
     public:
-        equation(const std::string name,
-                std::shared_ptr<const expr> lhs,
-                std::shared_ptr<const expr> rhs);
+        equation(const std::string name, expr_ptr lhs, expr_ptr rhs,
+                const std::vector<const bc *>& bcs = {});
         equation(const bc& cond) = delete;
         // equation(const equation& e) : equation(e.name, e.lhs.copy(), e.rhs.copy()) {
         //     for (auto bc: e.bcs) {
@@ -262,11 +504,12 @@ class equation : public ast {
         const std::string name;
         const expr& lhs;
         const expr& rhs;
-        std::vector<std::shared_ptr<const bc>> bcs;
-
-        void add_bc(std::shared_ptr<const bc> bc);
+        const std::vector<const bc *> bcs;
 
         virtual operator std::string() const;
+
+        virtual size_t n_children() const { return 2 + bcs.size(); }
+        virtual const ast *child(size_t i) const;
 };
 
 typedef enum bc_loc {
@@ -278,26 +521,35 @@ typedef enum bc_loc {
 
 class bc : public ast {
     public:
-        bc(std::shared_ptr<const equation> cond, const int& loc);
+        bc(const equation *cond, const int& loc);
         bc(const bc& cond) = delete;
         const equation& eq;
         const int bc_loc;
         virtual operator std::string() const;
+
+        virtual size_t n_children() const { return 1; }
+        virtual const ast *child(size_t) const { return &eq; }
 };
 
-func sin(const expr& e);
-func cos(const expr& e);
-div_expr div(const expr& e);
-grad_expr grad(const expr& e);
-lap_expr lap(const expr& e);
-func pow(const expr& e, int p);
+/// \brief Returns `e' as a T if it is one, NULL otherwise
+template <class T>
+const T *as(const expr& e) {
+    return T::classof(e) ? static_cast<const T *>(&e) : NULL;
+}
+
+expr_ptr sin(const expr& e);
+expr_ptr cos(const expr& e);
+expr_ptr div(const expr& e);
+expr_ptr grad(const expr& e);
+expr_ptr lap(const expr& e);
+expr_ptr pow(const expr& e, int p);
 
 } // end namespace ir
 
-ir::bin_expr operator+(const ir::expr& l, const ir::expr& r);
-ir::bin_expr operator*(const ir::expr& l, const ir::expr& r);
-ir::bin_expr operator-(const ir::expr& l, const ir::expr& r);
-ir::bin_expr operator/(const ir::expr& l, const ir::expr& r);
-ir::unary_expr operator-(const ir::expr& e);
+ir::expr_ptr operator+(const ir::expr& l, const ir::expr& r);
+ir::expr_ptr operator*(const ir::expr& l, const ir::expr& r);
+ir::expr_ptr operator-(const ir::expr& l, const ir::expr& r);
+ir::expr_ptr operator/(const ir::expr& l, const ir::expr& r);
+ir::expr_ptr operator-(const ir::expr& e);
 
 #endif
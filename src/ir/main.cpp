@@ -1,37 +1,291 @@
 #include "ir.hpp"
+#include "visitor.hpp"
+#include "tape.hpp"
+#include "simplify.hpp"
+#include "derivative.hpp"
+#include "solver.hpp"
 
 #include <iostream>
-
-#define ptr std::shared_ptr
+#include <memory>
+#include <sstream>
 
 void test_func() {
-    ir::identifier a("a");
-    ir::identifier b("b");
-    ir::identifier c("c");
+    auto a = ir::make<ir::identifier>("a");
+    auto b = ir::make<ir::identifier>("b");
+    auto c = ir::make<ir::identifier>("c");
+
+    ir::expr_ptr ab = *a * *b;
+    ir::expr_ptr e1 = ir::grad(*(*ab + *c));
+    e1->display("grad");
+
+}
+
+void test_sharing() {
+    auto a = ir::make<ir::identifier>("a");
+    auto b = ir::make<ir::identifier>("b");
+
+    if (a != ir::make<ir::identifier>("a"))
+        error("identifiers are not shared");
+    if (a->sym != ir::intern("a") || ir::name_of(b->sym) != "b"
+            || a->sym == b->sym)
+        error("symbol table failed");
+
+    ir::expr_ptr e1 = ir::sin(*(*a + *b));
+    size_t n = ir::context::current().n_nodes();
+    ir::expr_ptr e2 = ir::sin(*(*a + *b));
+    if (e1 != e2)
+        error("expressions are not shared");
+    if (ir::context::current().n_nodes() != n)
+        error("shared expressions allocated twice");
+
+    if (*a - *b == *b - *a)
+        error("operands order ignored");
+}
+
+void test_hash() {
+    auto a = ir::make<ir::identifier>("a");
+    auto b = ir::make<ir::identifier>("b");
+
+    // built outside of the context: not shared with the interned nodes
+    ir::value one(1.), two(2.);
+    ir::func f1("pow", std::vector<ir::expr_ptr>({a, &one}));
+    ir::func f2("pow", std::vector<ir::expr_ptr>({a, &two}));
+    if (f1 == f2)
+        error("functions with different arguments are equal");
+    if (f1 != *ir::pow(*a, 1) || f1.hash() != ir::pow(*a, 1)->hash())
+        error("structurally equal functions differ");
+
+    ir::expr_map<int> m;
+    m[*a + *b] = 1;
+    m[*b + *a] = 2;
+    m[&f1] = 3;
+    if (m.size() != 3 || m[ir::pow(*a, 1)] != 3)
+        error("expression map failed");
+}
+
+// substitutes identifier `from' by identifier `to'
+class substitute : public ir::rewriter {
+    public:
+        substitute(const std::string& from, const std::string& to)
+            : from(from), to(to) { }
+
+    protected:
+        ir::expr_ptr visit_identifier(const ir::identifier& id) {
+            if (id.name == from) return ir::make<ir::identifier>(to);
+            return &id;
+        }
+
+    private:
+        const std::string from, to;
+};
+
+void test_rewriter() {
+    auto a = ir::make<ir::identifier>("a");
+    auto b = ir::make<ir::identifier>("b");
+    auto c = ir::make<ir::identifier>("c");
+
+    ir::expr_ptr e = ir::lap(*(*(*a * *b) + *ir::cos(*b)));
+    substitute r("b", "c");
+    if (r.rewrite(*e) != ir::lap(*(*(*a * *c) + *ir::cos(*c))))
+        error("rewriter failed");
+    if (r.rewrite(*a) != a)
+        error("rewriter rebuilt an unchanged expression");
+}
+
+void test_tape() {
+    auto r = ir::make<ir::identifier>("r");
+    auto x = ir::make<ir::identifier>("x");
+    ir::expr_ptr lhs = ir::lap(*(*ir::pow(*x, 2) - *ir::sin(*x)));
+    ir::expr_ptr rhs = ir::make<ir::diff_expr>(
+            ir::make<ir::field_value>("x", ir::make<ir::value>(1)), r);
+
+    ir::tape t;
+    ir::tape::index l = t.record(*lhs);
+    ir::tape::index n = t.size();
+    ir::tape::index r_ = t.record(*rhs);
+    if (t.record(*lhs) != l || t.size() <= n)
+        error("tape recorded an expression twice");
+    if (t.rebuild(l) != lhs || t.rebuild(r_) != rhs)
+        error("tape rebuilt a different expression");
+
+    // deep expressions are recorded without recursion
+    ir::expr_ptr sum = x;
+    for (int i=0; i<100000; i++)
+        sum = *sum + *ir::make<ir::value>(i);
+    ir::tape deep;
+    if (deep.rebuild(deep.record(*sum)) != sum)
+        error("tape failed on a deep expression");
+}
+
+void test_simplify() {
+    auto x = ir::make<ir::identifier>("x");
+    auto y = ir::make<ir::identifier>("y");
+    auto zero = ir::make<ir::value>(0);
+    auto one = ir::make<ir::value>(1);
+    auto two = ir::make<ir::value>(2);
+
+    if (ir::simplify(*(*(*two * *ir::make<ir::value>(3)) + *one))
+            != ir::make<ir::value>(7))
+        error("constant folding failed");
+    if (ir::simplify(*(*(*x * *one) + *(*y * *zero))) != x)
+        error("identity simplification failed");
+    if (ir::simplify(*(*x - *x)) != zero)
+        error("x-x not simplified");
+    if (ir::simplify(*-*-*x) != x)
+        error("double negation not simplified");
+    if (ir::simplify(*(*x - *-*y)) != *x + *y)
+        error("negation not normalized");
+    if (ir::simplify(*(*-*x * *y)) != -*(*x * *y))
+        error("negation not pulled out of product");
+    if (ir::simplify(*(*(*x * *x) * *ir::pow(*x, 2))) != ir::pow(*x, 4))
+        error("powers not merged");
+    if (ir::simplify(*ir::pow(*x, 1)) != x
+            || ir::simplify(*ir::pow(*two, 3)) != ir::make<ir::value>(8))
+        error("powers not folded");
+
+    // left-deep sums, as built by the parser, are simplified without
+    // recursion
+    ir::expr_ptr sum = x;
+    for (int i=1; i<100000; i++)
+        sum = *sum + *(*ir::make<ir::value>(i) * *x);
+    auto be = ir::as<ir::bin_expr>(*ir::simplify(*sum));
+    if (!be || be->op != '+'
+            || &be->rhs != *ir::make<ir::value>(99999) * *x)
+        error("simplification failed on a deep expression");
+}
+
+void test_derivative() {
+    auto x = ir::make<ir::identifier>("x");
+    auto y = ir::make<ir::identifier>("y");
+    auto n = ir::make<ir::identifier>("n");
+    ir::symbol sx = x->sym, sy = y->sym;
+    ir::differentiator der([=](ir::symbol s) { return s == sx || s == sy; });
+
+    // d(x^n)/dx = n*x^(n-1), n is a parameter
+    ir::expr_ptr p = ir::pow(*x, 3);
+    if (der.derivative(*p, sx) != *ir::make<ir::value>(3) * *ir::pow(*x, 2))
+        error("derivative of pow failed");
+    if (der.derivative(*ir::sin(*(*x * *y)), sy) != *ir::cos(*(*x * *y)) * *x)
+        error("chain rule failed");
+    if (der.derivative(*(*x / *y), sx) != *ir::make<ir::value>(1) / *y)
+        error("derivative of a quotient failed");
+    if (der.derivative(*(*n * *y), sx) != ir::make<ir::value>(0))
+        error("derivative of a constant failed");
+
+    auto dx = ir::make<ir::delta>("x");
+    if (der.linearize(*ir::lap(*(*n * *x))) != ir::lap(*(*n * *dx)))
+        error("linearization of a linear operator failed");
+}
+
+// the whole solver pipeline (simplification, linearization, emission) runs
+// on a long sum, which the parser builds as a left-deep tree
+void test_deep_solver() {
+    auto x = ir::make<ir::identifier>("x");
+    auto k = ir::make<ir::identifier>("k");
+    ir::expr_ptr sum = x;
+    for (int i=1; i<50000; i++)
+        sum = *sum + *(*(*ir::make<ir::value>(i) * *x) * *k);
+
+    ir::solver s;
+    s.add_var(std::make_shared<ir::variable>(x->sym, ir::FIELD));
+    s.add_param(k->sym, "double");
+    s.add_eq(ir::make<ir::equation>("x", ir::lap(*x), sum));
+    s.set_newton_driver(true);
+    std::ostringstream os;
+    s.emit_code(os);
+    if (os.str().find("49999*x[ipt]*k") == std::string::npos
+            || os.str().find("jacobian_x_x") == std::string::npos)
+        error("solver failed on a deep expression");
+}
+
+// update_rhs() does not compute the temporaries of the operator only
+void test_rhs_temporaries() {
+    auto u = ir::make<ir::identifier>("u");
+    auto v = ir::make<ir::identifier>("v");
+    ir::expr_ptr uv = *u + *v;
+
+    ir::solver s;
+    s.add_var(std::make_shared<ir::variable>(u->sym, ir::FIELD));
+    s.add_var(std::make_shared<ir::variable>(v->sym, ir::FIELD));
+    s.add_eq(ir::make<ir::equation>("u",
+                *(*uv * *ir::lap(*u)) + *(*uv * *ir::lap(*v)),
+                ir::make<ir::value>(1)));
+    s.add_eq(ir::make<ir::equation>("v", ir::lap(*v), u));
+    s.set_newton_driver(true);
+    std::ostringstream os;
+    s.emit_code(os);
+    std::string code = os.str();
+    size_t rhs = code.find("::update_rhs()");
+    if (rhs == std::string::npos
+            || code.find("= sym_u+sym_v;") > rhs
+            || code.find("= sym_u+sym_v;", rhs) != std::string::npos
+            || code.find("= lap(sym_u);", rhs) == std::string::npos)
+        error("wrong temporaries in update_rhs()");
+}
 
-    ir::grad_expr e1 = ir::grad(a*b + c);
-    e1.display("grad");
+// with -parallel, update() computes the jacobian coefficients in tasks and
+// adds them to the operator after the tasks
+void test_parallel_assembly() {
+    auto u = ir::make<ir::identifier>("u");
+    auto v = ir::make<ir::identifier>("v");
 
+    ir::solver s;
+    s.add_var(std::make_shared<ir::variable>(u->sym, ir::FIELD));
+    s.add_var(std::make_shared<ir::variable>(v->sym, ir::FIELD));
+    s.add_eq(ir::make<ir::equation>("u", ir::lap(*u), *u * *v));
+    s.add_eq(ir::make<ir::equation>("v", ir::lap(*v), *u * *u));
+    s.set_parallel(true);
+    std::ostringstream os;
+    s.emit_code(os);
+    std::string code = os.str();
+    size_t update = code.find("::update()");
+    size_t task = code.find("#pragma omp task", update);
+    size_t kernel = code.find("jacobian_u_v(", task);
+    size_t end = code.find("::update_rhs()", update);
+    size_t add = code.find("op->add_d(\"u\", \"v\", jac_u_v);", update);
+    if (update == std::string::npos || task > kernel || kernel > add
+            || add > end || code.find("#pragma omp task", add) < end)
+        error("jacobian kernels not called in tasks");
 }
 
 void build_pb() {
-    ir::identifier phi("phi");
-    ir::identifier rho("rho");
-    ir::lap_expr lap_phi = ir::lap(phi);
+    auto phi = ir::make<ir::identifier>("phi");
+    auto rho = ir::make<ir::identifier>("rho");
+    ir::expr_ptr lap_phi = ir::lap(*phi);
 
-    std::shared_ptr<ir::equation> poisson =
-        std::make_shared<ir::equation>("poisson", lap_phi.copy(), rho.copy());
+    const ir::equation *poisson =
+        ir::make<ir::equation>("poisson", lap_phi, rho);
     poisson->display("poisson");
     // poisson->add_bc();
 }
 
 int main() {
 
-    test_func();
-    build_pb();
+    try {
+        ir::context ctx;
+        test_func();
+        test_sharing();
+        test_hash();
+        test_rewriter();
+        test_tape();
+        test_simplify();
+        test_derivative();
+        test_deep_solver();
+        test_rhs_temporaries();
+        test_parallel_assembly();
+        build_pb();
+        log::log() << "Arena: " << ctx.n_nodes() << " nodes, "
+            << ctx.bytes() << " bytes\n";
+    }
+    catch (log::fatal_error& e) {
+        log::err() << e.what() << '\n';
+        return EXIT_FAILURE;
+    }
     log::log() << "Nodes: " << ir::n_nodes << "\n";
-    if (ir::n_nodes > 0)
-        error("Memory leak!");
+    if (ir::n_nodes > 0) {
+        log::err() << "Memory leak!\n";
+        return EXIT_FAILURE;
+    }
 
-    return 0;
+    return EXIT_SUCCESS;
 }
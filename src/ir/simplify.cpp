@@ -0,0 +1,202 @@
+#include "simplify.hpp"
+#include "tape.hpp"
+
+namespace ir {
+
+static inline bool is_value(expr_ptr e, double v) {
+    auto val = as<value>(*e);
+    return val && val->val == v;
+}
+
+static inline bool is_integer(double v) {
+    return v > -1e9 && v < 1e9 && v == (double) (long) v;
+}
+
+static inline expr_ptr neg_operand(expr_ptr e) {
+    if (auto ue = as<unary_expr>(*e)) {
+        if (ue->op == '-') return &ue->expr;
+    }
+    return NULL;
+}
+
+// integer power by squaring, `p' has to be an integer
+static double int_pow(double b, double p) {
+    long n = (long) p;
+    double r = 1;
+    if (n < 0) {
+        b = 1/b;
+        n = -n;
+    }
+    while (n) {
+        if (n & 1) r *= b;
+        b *= b;
+        n >>= 1;
+    }
+    return r;
+}
+
+// splits `e' in base and numerical exponent: pow(x, 2) -> (x, 2), x -> (x, 1)
+static expr_ptr split_pow(expr_ptr e, double& p) {
+    if (auto f = as<func>(*e)) {
+        if (f->name == "pow" && f->args.size() == 2) {
+            if (auto v = as<value>(*f->args[1])) {
+                p = v->val;
+                return f->args[0];
+            }
+        }
+    }
+    p = 1;
+    return e;
+}
+
+static expr_ptr add(expr_ptr l, expr_ptr r);
+static expr_ptr sub(expr_ptr l, expr_ptr r);
+static expr_ptr mul(expr_ptr l, expr_ptr r);
+static expr_ptr quo(expr_ptr l, expr_ptr r);
+
+static expr_ptr add(expr_ptr l, expr_ptr r) {
+    auto lv = as<value>(*l);
+    auto rv = as<value>(*r);
+    if (lv && rv) return make<value>(lv->val + rv->val);
+    if (is_value(l, 0)) return r;
+    if (is_value(r, 0)) return l;
+    if (rv && rv->val < 0) return sub(l, make<value>(-rv->val));
+    if (auto y = neg_operand(r)) return sub(l, y);
+    if (auto x = neg_operand(l)) return sub(r, x);
+    if (l == r) return mul(make<value>(2), l);
+    return make<bin_expr>(l, '+', r);
+}
+
+static expr_ptr sub(expr_ptr l, expr_ptr r) {
+    auto lv = as<value>(*l);
+    auto rv = as<value>(*r);
+    if (lv && rv) return make<value>(lv->val - rv->val);
+    if (is_value(r, 0)) return l;
+    if (is_value(l, 0)) return simplify_neg(r);
+    if (l == r) return make<value>(0);
+    if (rv && rv->val < 0) return add(l, make<value>(-rv->val));
+    if (auto y = neg_operand(r)) return add(l, y);
+    return make<bin_expr>(l, '-', r);
+}
+
+static expr_ptr mul(expr_ptr l, expr_ptr r) {
+    auto lv = as<value>(*l);
+    auto rv = as<value>(*r);
+    if (lv && rv) return make<value>(lv->val * rv->val);
+    if (is_value(l, 0) || is_value(r, 0)) return make<value>(0);
+    if (is_value(l, 1)) return r;
+    if (is_value(r, 1)) return l;
+    if (is_value(l, -1)) return simplify_neg(r);
+    if (is_value(r, -1)) return simplify_neg(l);
+
+    auto x = neg_operand(l);
+    auto y = neg_operand(r);
+    if (x && y) return mul(x, y);
+    if (x) return simplify_neg(mul(x, r));
+    if (y) return simplify_neg(mul(l, y));
+
+    double pl, pr;
+    expr_ptr bl = split_pow(l, pl);
+    expr_ptr br = split_pow(r, pr);
+    if (bl == br && !as<value>(*bl))
+        return simplify_pow(bl, make<value>(pl + pr));
+
+    return make<bin_expr>(l, '*', r);
+}
+
+static expr_ptr quo(expr_ptr l, expr_ptr r) {
+    auto lv = as<value>(*l);
+    auto rv = as<value>(*r);
+    if (lv && rv && rv->val != 0) return make<value>(lv->val / rv->val);
+    if (is_value(r, 1)) return l;
+    if (is_value(l, 0) && !is_value(r, 0)) return l;
+
+    auto x = neg_operand(l);
+    auto y = neg_operand(r);
+    if (x && y) return quo(x, y);
+    if (x) return simplify_neg(quo(x, r));
+    if (y) return simplify_neg(quo(l, y));
+
+    return make<bin_expr>(l, '/', r);
+}
+
+expr_ptr simplify_bin(expr_ptr l, char op, expr_ptr r) {
+    switch (op) {
+        case '+':
+            return add(l, r);
+        case '-':
+            return sub(l, r);
+        case '*':
+            return mul(l, r);
+        case '/':
+            return quo(l, r);
+        default:
+            return make<bin_expr>(l, op, r);
+    }
+}
+
+expr_ptr simplify_neg(expr_ptr e) {
+    if (auto v = as<value>(*e)) return make<value>(-v->val);
+    if (auto x = neg_operand(e)) return x;
+    if (auto be = as<bin_expr>(*e)) {
+        if (be->op == '-') return sub(&be->rhs, &be->lhs);
+    }
+    return make<unary_expr>('-', e);
+}
+
+expr_ptr simplify_pow(expr_ptr b, expr_ptr p) {
+    auto pv = as<value>(*p);
+    if (pv && pv->val == 0) return make<value>(1);
+    if (pv && pv->val == 1) return b;
+    if (pv && is_integer(pv->val)) {
+        if (auto bv = as<value>(*b)) {
+            if (bv->val != 0 || pv->val > 0)
+                return make<value>(int_pow(bv->val, pv->val));
+        }
+        // (x^a)^b = x^(a*b) only holds for integer exponents
+        double a;
+        expr_ptr x = split_pow(b, a);
+        if (x != b && is_integer(a))
+            return simplify_pow(x, make<value>(a * pv->val));
+    }
+    std::vector<expr_ptr> args;
+    args.push_back(b);
+    args.push_back(p);
+    return make<func>("pow", args);
+}
+
+// simplifies entry `i' of `t', the simplified operands are in `memo'
+static expr_ptr simplify_node(const tape& t, tape::index i,
+        const std::vector<expr_ptr>& memo) {
+    auto arg = [&](size_t j) { return memo[t.operand(i, j)]; };
+    switch (t.kind(i)) {
+        case BIN_EXPR:
+            return simplify_bin(arg(0), t.op(i), arg(1));
+        case UNARY_EXPR:
+            if (t.op(i) == '-') return simplify_neg(arg(0));
+            break;
+        case FUNC:
+            if (t.name(i) == "pow" && t.n_operands(i) == 2)
+                return simplify_pow(arg(0), arg(1));
+            break;
+        default:
+            break;
+    }
+    for (size_t j=0; j<t.n_operands(i); j++) {
+        if (arg(j) != t.node(t.operand(i, j))) return t.make_node(i, memo);
+    }
+    return t.node(i);
+}
+
+expr_ptr simplify(const expr& e) {
+    // operands come first in the tape: a single loop simplifies the
+    // expression bottom-up, whatever its depth
+    tape t;
+    tape::index root = t.record(e);
+    std::vector<expr_ptr> memo(t.size(), NULL);
+    for (tape::index i=0; i<t.size(); i++)
+        memo[i] = simplify_node(t, i, memo);
+    return memo[root];
+}
+
+} // end namespace ir
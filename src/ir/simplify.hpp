@@ -0,0 +1,35 @@
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+
+#include "ir.hpp"
+
+namespace ir {
+
+/// \brief Returns the simplified version of expression `e'
+///
+/// Expressions are simplified bottom-up, in a single loop over a tape, with
+/// the following rules:
+///  - operations on numerical values are folded,
+///  - identities and annihilators: x+0, x-0, 0-x, x*1, x*0, x/1, 0/x, x-x,
+///  - negations are pushed out of additions, subtractions, products and
+///    quotients and double negations removed,
+///  - products of powers of a same base are merged (x*x = pow(x, 2)) and
+///    powers with numerical exponents are folded.
+///
+expr_ptr simplify(const expr& e);
+
+/// \brief Builds l+r, l-r, l*r or l/r and simplifies the result, assuming `l'
+/// and `r' are already simplified
+expr_ptr simplify_bin(expr_ptr l, char op, expr_ptr r);
+
+/// \brief Builds -e and simplifies the result, assuming `e' is already
+/// simplified
+expr_ptr simplify_neg(expr_ptr e);
+
+/// \brief Builds pow(b, p) and simplifies the result, assuming `b' and `p'
+/// are already simplified
+expr_ptr simplify_pow(expr_ptr b, expr_ptr p);
+
+} // end namespace ir
+
+#endif
@@ -2,27 +2,50 @@
 #define SOLVER_H
 
 #include "ir.hpp"
+#include "tape.hpp"
+#include "simplify.hpp"
+#include "derivative.hpp"
 #include "path.hpp"
 
+#include <algorithm>
+#include <cstdlib>
 #include <fstream>
+#include <functional>
 #include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_set>
+
+#include <unistd.h>
 
 namespace ir {
 
 class variable {
     public:
-        variable(const std::string& name, var_type type) : name(name), type(type) { }
+        variable(symbol sym, var_type type)
+            : sym(sym), name(name_of(sym)), type(type) { }
         ~variable() { }
 
+        const symbol sym;
         const std::string name;
         const var_type type;
 };
 
+/// \brief Directory of the templates: $ESTER_LANG_TEMPLATES, the installed
+/// templates, or those of the source tree when ester-lang is not installed
+inline std::string templates_dir() {
+    if (const char *dir = std::getenv("ESTER_LANG_TEMPLATES"))
+        return dir;
+    if (access((TEMPLATES_DIR + "/et.hpp").c_str(), R_OK) == 0)
+        return TEMPLATES_DIR;
+    return ABS_TOP_SRCDIR + "/templates";
+}
+
 inline void write_template_file(std::ostream& os, const std::string& name) {
     std::ifstream file;
     char line[256];
-    file.open(ABS_TOP_SRCDIR + "/templates/" + name,
-            std::ios::in);
+    file.open(templates_dir() + "/" + name, std::ios::in);
     if (!file.is_open()) {
         log::err() << "Could not open template file " << name << '\n';
     }
@@ -34,25 +57,116 @@ inline void write_template_file(std::ostream& os, const std::string& name) {
 }
 
 class solver {
+        friend class et_backend;
+
+        // arguments of a kernel: name, and whether it is an array
+        typedef std::vector<std::pair<std::string, bool>> kernel_args;
+
+        // code computing the RHS (or the jacobian coefficients) of an
+        // equation: `serial' runs on the calling thread (symbolic
+        // evaluations, allocations), `local' only writes rhs_<eq> (or the
+        // jac_<eq>_<var>) and `commit' passes them to the operator. If
+        // `concurrent', `local' runs in a task and cannot declare rhs_<eq>.
+        struct rhs_code {
+            bool concurrent;
+            std::ostringstream serial, local, commit;
+        };
+
+        /// \brief Starts the statement assigning rhs_<name> in `rhs.local'
+        static void begin_rhs(rhs_code& rhs, const std::string& name) {
+            if (rhs.concurrent) {
+                rhs.serial << "    matrix rhs_" << name << ";\n";
+                rhs.local << "    rhs_" << name << " = ";
+            }
+            else {
+                rhs.local << "    matrix rhs_" << name << " = ";
+            }
+        }
+
+        // piece of code written by an emitter: a sub-expression, or `text'
+        // if `e' is NULL
+        struct piece {
+            piece(expr_ptr e) : e(e) { }
+            piece(const std::string& text) : e(NULL), text(text) { }
+            expr_ptr e;
+            std::string text;
+        };
+
+        /// \brief Writes `pieces', `expand(e, out)' appends the pieces of
+        /// sub-expression `e' to `out'
+        ///
+        /// Sub-expressions are expanded from an explicit stack rather than
+        /// recursively: a sum of many terms is a deep tree, which would
+        /// overflow the call stack.
+        template <class F>
+        static void write_pieces(std::ostream& os,
+                const std::vector<piece>& pieces, F expand) {
+            std::vector<piece> stack(pieces.rbegin(), pieces.rend());
+            std::vector<piece> out;
+            while (!stack.empty()) {
+                piece p = std::move(stack.back());
+                stack.pop_back();
+                if (!p.e) {
+                    os << p.text;
+                    continue;
+                }
+                out.clear();
+                expand(*p.e, out);
+                stack.insert(stack.end(), std::make_move_iterator(out.rbegin()),
+                        std::make_move_iterator(out.rend()));
+            }
+        }
+
+        /// \brief Returns the terms of sum `e', with whether they are
+        /// subtracted. Differences and negations are only expanded if
+        /// `signed_terms'.
+        static std::vector<std::pair<expr_ptr, bool>> sum_terms(const expr& e,
+                bool signed_terms = true) {
+            std::vector<std::pair<expr_ptr, bool>> terms;
+            // right operands are pushed first to keep the order of the terms
+            std::vector<std::pair<expr_ptr, bool>> stack;
+            stack.push_back(std::make_pair(&e, false));
+            while (!stack.empty()) {
+                auto t = stack.back();
+                stack.pop_back();
+                auto be = as<bin_expr>(*t.first);
+                if (be && (be->op == '+' || (signed_terms && be->op == '-'))) {
+                    stack.push_back(std::make_pair(&be->rhs,
+                                t.second != (be->op == '-')));
+                    stack.push_back(std::make_pair(&be->lhs, t.second));
+                    continue;
+                }
+                auto ue = as<unary_expr>(*t.first);
+                if (signed_terms && ue && ue->op == '-') {
+                    stack.push_back(std::make_pair(&ue->expr, !t.second));
+                    continue;
+                }
+                terms.push_back(t);
+            }
+            return terms;
+        }
+
     public:
-        solver() { }
+        solver() : der([this](symbol s) { return is_var(s); }) { }
         ~solver() { vars.clear(); }
 
         int add_var(std::shared_ptr<const variable> var) {
-            for (auto v: vars) {
-                if (v->name == var->name) {
-                    return 1;
-                }
+            if (is_var(var->sym)) {
+                return 1;
             }
+            if (var->sym >= var_index.size())
+                var_index.resize(var->sym + 1, -1);
+            var_index[var->sym] = vars.size();
             vars.push_back(var);
             return 0;
         }
 
-        void add_param(const std::string& name, const std::string& type) {
-            params[name] = type;
+        void add_param(symbol sym, const std::string& type) {
+            params[name_of(sym)] = type;
+            mark(param_syms, sym);
         }
 
-        void add_eq(std::shared_ptr<const equation> eq) {
+        void add_eq(const equation *eq) {
             eqs.push_back(eq);
         }
 
@@ -76,10 +190,63 @@ class solver {
                 log::log() << "        - " << eq->name
                     << " (BCs: " << eq->bcs.size() << ")" << '\n';
             }
+
+            auto pattern = jacobian_pattern();
+            size_t nnz = 0;
+            for (auto& row: pattern)
+                nnz += std::count(row.begin(), row.end(), true);
+            log::log() << "  - Jacobian blocks (" << nnz << "/"
+                << eqs.size() * vars.size() << " non zero):\n";
+            for (size_t i=0; i<eqs.size(); i++) {
+                log::log() << "        - " << eqs[i]->name << ":";
+                for (size_t j=0; j<vars.size(); j++) {
+                    if (pattern[i][j]) log::log() << " " << vars[j]->name;
+                }
+                log::log() << '\n';
+            }
+        }
+
+        /// \brief Computes the block-sparsity pattern of the jacobian
+        ///
+        /// Block (i, j) is non zero if the linearization of equation i (or of
+        /// one of its BCs), once simplified, depends on variable j.
+        std::vector<std::vector<bool>> jacobian_pattern() {
+            std::vector<std::vector<bool>> pattern;
+            for (auto eq: eqs) {
+                std::vector<bool> row(vars.size(), false);
+                add_couplings(row, *eq);
+                for (auto bc: eq->bcs)
+                    add_couplings(row, bc->eq);
+                pattern.push_back(row);
+            }
+            return pattern;
+        }
+
+        void add_couplings(std::vector<bool>& row, const equation& eq) {
+            tape t;
+            t.record(*func_der(*simplify(*(eq.lhs - eq.rhs))));
+            for (tape::index i=0; i<t.size(); i++) {
+                if (t.kind(i) == DELTA)
+                    row[var_index[t.sym(i)]] = true;
+            }
         }
 
+        /// \brief Generates newton_solve() along with the solver contexts
+        void set_newton_driver(bool enable) { newton_driver = enable; }
+
+        /// \brief Makes the generated newton_solve() a modified Newton
+        /// method, which keeps the operator of previous iterations as long
+        /// as the iterations contract fast enough
+        void set_reuse_jacobian(bool enable) { reuse_jacobian = enable; }
+
+        /// \brief Generates code computing the jacobian coefficients and the
+        /// RHS of the equations of a block concurrently and kernels looping
+        /// in parallel (OpenMP)
+        void set_parallel(bool enable) { parallel = enable; }
+
         void emit_code(std::ostream& os) {
-            os << "#include <ester.h>\n\n";
+            os << "#include <ester.h>\n";
+            os << "#include <algorithm>\n\n";
             write_template_file(os, "mapping.cpp");
 
             for (auto p: params) {
@@ -94,61 +261,473 @@ class solver {
             for (auto v: vars) {
                 os << "extern matrix " << v->name << ";\n";
             }
+            os << '\n';
+            if (parallel)
+                os << "#define ESTER_PARALLEL\n";
+            write_template_file(os, "simd.hpp");
+            write_template_file(os, "solver_context.hpp");
+
+            auto pattern = jacobian_pattern();
+            auto blocks = block_decomposition(pattern);
+            unknowns.assign(vars.size(), blocks.size() == 1);
+            for (size_t k=0; k<blocks.size(); k++) {
+                // unknowns of the block, other variables are known values.
+                // Only the variables of the block are visited, so that
+                // emitting many small blocks stays linear.
+                std::vector<size_t> block_index;
+                if (blocks.size() == 1) {
+                    for (size_t j=0; j<vars.size(); j++)
+                        block_index.push_back(j);
+                }
+                for (auto i: blocks[k]) {
+                    symbol sym;
+                    if (blocks.size() > 1 &&
+                            context::current().symbols().find(eqs[i]->name,
+                                sym) && is_var(sym)) {
+                        unknowns[var_index[sym]] = true;
+                        block_index.push_back(var_index[sym]);
+                    }
+                }
+                std::sort(block_index.begin(), block_index.end());
+                block_vars.clear();
+                for (auto j: block_index)
+                    block_vars.push_back(vars[j]);
+
+                // first pass: collects the expressions written by the
+                // block to find the sub-expressions shared between them
+                std::ostringstream dry_run;
+                for (int symbolic=0; symbolic<2; symbolic++) {
+                    cse_roots[symbolic].clear();
+                    temps[symbolic].clear();
+                    temp_defs[symbolic].clear();
+                }
+                collecting = true;
+                emit_solver_block(dry_run, k, blocks.size(), pattern,
+                        blocks[k]);
+                collecting = false;
+                find_temporaries(false);
+                find_temporaries(true);
+
+                emit_solver_block(os, k, blocks.size(), pattern, blocks[k]);
+                if (blocks.size() > 1) {
+                    for (auto j: block_index)
+                        unknowns[j] = false;
+                }
+            }
+            unknowns.assign(vars.size(), true);
+            block_vars = vars;
+
+            os << "const int n_solver_blocks = " << blocks.size() << ";\n\n";
+            os << "solver_context *create_solver_context(int block) {\n";
+            os << "    switch (block) {\n";
+            for (size_t k=0; k<blocks.size(); k++) {
+                os << "        case " << k << ": return new solver_block_"
+                    << k << "();\n";
+            }
+            os << "        default: return NULL;\n";
+            os << "    }\n";
+            os << "}\n";
+
+            if (newton_driver) {
+                os << "\nconst bool newton_reuse_jacobian = "
+                    << (reuse_jacobian ? "true" : "false") << ";\n\n";
+                write_template_file(os, "newton.cpp");
+            }
+        }
+
+        /// \brief Orders the equations in blocks such that the jacobian is
+        /// block lower triangular
+        ///
+        /// Each equation determines the variable it is named after. Blocks
+        /// are the strongly connected components of the dependency graph
+        /// between equations, in an order where a block only depends on the
+        /// previous ones. If equations and variables cannot be matched by
+        /// name, all equations end up in a single block.
+        std::vector<std::vector<size_t>> block_decomposition(
+                const std::vector<std::vector<bool>>& pattern) {
+            std::vector<std::vector<size_t>> blocks;
+            std::vector<int> eq_of_var(vars.size(), -1);
+            bool matched = eqs.size() == vars.size();
+            for (size_t i=0; i<eqs.size() && matched; i++) {
+                symbol sym;
+                if (!context::current().symbols().find(eqs[i]->name, sym)
+                        || !is_var(sym)
+                        || eq_of_var[var_index[sym]] != -1) {
+                    matched = false;
+                    break;
+                }
+                eq_of_var[var_index[sym]] = i;
+            }
+            if (!matched) {
+                blocks.push_back(std::vector<size_t>());
+                for (size_t i=0; i<eqs.size(); i++)
+                    blocks.back().push_back(i);
+                return blocks;
+            }
+
+            // Tarjan's algorithm: a component is complete once all the
+            // components it depends on are, which gives the solve order.
+            // The depth first search keeps its own stack of (equation, next
+            // variable to look at): a long chain of dependencies does not
+            // overflow the call stack.
+            std::vector<int> index(eqs.size(), -1), low(eqs.size(), 0);
+            std::vector<bool> on_stack(eqs.size(), false);
+            std::vector<size_t> stack;
+            std::vector<std::pair<size_t, size_t>> calls;
+            int counter = 0;
+            auto visit = [&](size_t i) {
+                index[i] = low[i] = counter++;
+                stack.push_back(i);
+                on_stack[i] = true;
+                calls.push_back(std::make_pair(i, 0));
+            };
+            for (size_t root=0; root<eqs.size(); root++) {
+                if (index[root] != -1) continue;
+                visit(root);
+                while (!calls.empty()) {
+                    size_t i = calls.back().first;
+                    size_t j = calls.back().second;
+                    while (j < vars.size() && !pattern[i][j]) j++;
+                    if (j < vars.size()) {
+                        calls.back().second = j + 1;
+                        size_t k = eq_of_var[j];
+                        if (index[k] == -1)
+                            visit(k);
+                        else if (on_stack[k])
+                            low[i] = std::min(low[i], index[k]);
+                        continue;
+                    }
+                    calls.pop_back();
+                    if (!calls.empty()) {
+                        size_t caller = calls.back().first;
+                        low[caller] = std::min(low[caller], low[i]);
+                    }
+                    if (low[i] == index[i]) {
+                        std::vector<size_t> block;
+                        size_t k;
+                        do {
+                            k = stack.back();
+                            stack.pop_back();
+                            on_stack[k] = false;
+                            block.push_back(k);
+                        } while (k != i);
+                        // keep the order in which equations were declared
+                        std::sort(block.begin(), block.end());
+                        blocks.push_back(block);
+                    }
+                }
+            }
+            return blocks;
+        }
+
+        /// \brief Writes the solver context of a block
+        ///
+        /// The constructor sets up the mapping, registers the unknowns and
+        /// allocates the operator once, update() only refreshes the values
+        /// of the operator and of the RHS.
+        void emit_solver_block(std::ostream& os, size_t k, size_t n_blocks,
+                const std::vector<std::vector<bool>>& pattern,
+                const std::vector<size_t>& block) {
+            std::string name = "solver_block_" + std::to_string(k);
+            if (n_blocks > 1) {
+                os << "// block " << k << " of " << n_blocks << "\n";
+            }
+            os << "class " << name << " : public solver_context {\n";
+            os << "    public:\n";
+            os << "        " << name << "();\n";
+            os << "        void update();\n";
+            os << "        void update_rhs();\n";
+            os << "        void start_step();\n";
+            os << "        void step(double lambda);\n";
+            os << "        double correction();\n";
+            os << "        double residual();\n";
+            os << "\n";
+            os << "    private:\n";
+            for (auto var: block_vars) {
+                os << "        sym sym_" << var->name << ";\n";
+            }
+            for (auto var: block_vars) {
+                os << "        matrix " << var->name << "_0, d_"
+                    << var->name << ";\n";
+            }
+            os << "};\n\n";
 
             // Register variables & symbolic obj
-            os << "solver *create_solver() {\n";
-            os << "    mapping map;\n";
-            os << "    symbolic S;\n";
-            os << "    solver *op = new solver();\n";
-            os << "    op->init(1, " << vars.size() << ", \"full\");\n";
+            os << name << "::" << name << "() {\n";
+            os << "    op->init(1, " << block.size() << ", \"full\");\n";
             os << "    create_map(map);\n";
             os << "    S.set_map(map);\n";
             os << "    op->set_nr(map.npts);\n";
-            for (auto var: vars) {
-                os << "    sym sym_" << var->name
+            for (auto var: block_vars) {
+                os << "    sym_" << var->name
                     << " = S.regvar(\"" << var->name << "\");\n";
                 os << "    op->regvar(\"" << var->name << "\");\n";
+            }
+            os << "}\n\n";
+
+            // kernels are written before the members calling them
+            std::ostringstream methods;
+            kernels.clear();
+            emit_update(methods, name, "update", pattern, block);
+            // the dry run only looks for temporaries in update()
+            if (!collecting) {
+                assemble = false;
+                emit_update(methods, name, "update_rhs", pattern, block);
+                assemble = true;
+            }
+            for (auto& k: kernels)
+                os << k.second;
+
+            os << methods.str();
+            emit_newton_step(os, name, block);
+        }
+
+        /// \brief Writes the member `method' of the context of a block,
+        /// which assembles the operator and the RHS, or only the RHS if
+        /// `assemble' is false
+        void emit_update(std::ostream& os, const std::string& name,
+                const std::string& method,
+                const std::vector<std::vector<bool>>& pattern,
+                const std::vector<size_t>& block) {
+            os << "void " << name << "::" << method << "() {\n";
+            if (assemble)
+                os << "    op->reset();\n";
+            for (auto var: block_vars) {
                 os << "    S.set_value(\"" << var->name << "\", "
                     << var->name << ");\n";
             }
-            for (auto eq: eqs) {
+            // the body is written first to know the temporaries it uses
+            std::ostringstream body;
+            used_temps[0].clear();
+            used_temps[1].clear();
+            emit_update_body(body, pattern, block);
+            emit_temporaries(os);
+            os << body.str();
+            os << "}\n\n";
+        }
+
+        /// \brief Writes the assembly of the operator if `assemble' is true,
+        /// and the RHS of the equations of `block'
+        void emit_update_body(std::ostream& os,
+                const std::vector<std::vector<bool>>& pattern,
+                const std::vector<size_t>& block) {
+            // the RHS of the equations, and their jacobian coefficients when
+            // the operator is assembled, are computed concurrently
+            bool tasks = parallel && (block.size() > 1 || assemble);
+            std::vector<std::string> locals;
+            std::string commits;
+            for (auto i: block) {
+                auto eq = eqs[i];
+                rhs_code jac, rhs;
+                jac.concurrent = rhs.concurrent = tasks;
                 if (eq->rhs.has_field_value() || eq->lhs.has_field_value()) {
-                    emit_eq_in_bc(os, *eq);
+                    emit_eq_in_bc(os, rhs, *eq);
                 }
                 else {
-                    os << "\n    sym eq_" << eq->name << " = ";
-                    emit_eq(os, eq);
-                    os << ";\n";
-
-                    std::vector<const identifier *> vars;
-                    get_vars(eq->lhs, vars);
-                    get_vars(eq->rhs, vars);
-                    for (auto id: vars) {
-                        os << "    eq_" << eq->name << ".add(op, \""
-                            << eq->name << "\", \""
-                            << id->name << "\");\n";
-                    }
+                    if (assemble) {
+                        emit_jacobian(os, jac, i, pattern);
 
-                    os << "\n    // Boundary conditions\n";
-                    for (auto bc: eq->bcs) {
-                        if (bc->eq.lhs != ir::value(0))
-                            emit_bc(os, eq->name, bc->bc_loc, bc->eq.lhs);
-                        if (bc->eq.rhs != ir::value(0))
-                            emit_bc(os, eq->name, bc->bc_loc, -bc->eq.rhs);
+                        os << "\n    // Boundary conditions\n";
+                        for (auto bc: eq->bcs) {
+                            if (bc->eq.lhs != ir::value(0))
+                                emit_bc(os, eq->name, bc->bc_loc,
+                                        bc->eq.lhs);
+                            if (bc->eq.rhs != ir::value(0))
+                                emit_bc(os, eq->name, bc->bc_loc,
+                                        *simplify_neg(&bc->eq.rhs));
+                        }
                     }
+                    emit_rhs(rhs, *eq);
+                }
 
-                    os << "\n    // RHS\n";
-                    emit_rhs(os, *eq);
+                os << "\n    // RHS\n";
+                os << rhs.serial.str();
+                if (tasks) {
+                    if (jac.local.tellp() > 0)
+                        locals.push_back(jac.local.str());
+                    locals.push_back(rhs.local.str());
+                    commits += jac.commit.str() + rhs.commit.str();
+                }
+                else {
+                    os << rhs.local.str() << rhs.commit.str();
                 }
             }
-            os << "    return op;\n";
-            os << "}\n";
+
+            if (tasks && locals.size() == 1) {
+                os << locals[0] << commits;
+            }
+            else if (tasks) {
+                // results do not depend on the scheduling: each task only
+                // writes its own matrices, which are passed to the operator
+                // (not thread-safe) in order once all are computed
+                os << "\n    // "
+                    << (assemble ? "jacobian coefficients and " : "")
+                    << "RHS evaluated concurrently\n";
+                os << "    #pragma omp parallel\n";
+                os << "    #pragma omp single\n";
+                os << "    {\n";
+                for (auto& local: locals) {
+                    os << "        #pragma omp task\n";
+                    os << "        {\n";
+                    std::istringstream lines(local);
+                    std::string line;
+                    while (std::getline(lines, line))
+                        os << "        " << line << "\n";
+                    os << "        }\n";
+                }
+                os << "    }\n";
+                os << commits;
+            }
+        }
+
+        /// \brief Writes the assembly of the jacobian of equation `i'
+        ///
+        /// The pointwise terms of the equation are linearized here: the
+        /// coefficient of each unknown is computed by a kernel and added to
+        /// the diagonal of the operator. Only the terms with differential
+        /// operators are linearized at run time by the symbolic object,
+        /// which adds them to the operator in the same call: they are
+        /// written to `os'. If `jac.concurrent', the kernel calls go to
+        /// `jac.local' and the additions to `jac.commit'.
+        void emit_jacobian(std::ostream& os, rhs_code& jac, size_t i,
+                const std::vector<std::vector<bool>>& pattern) {
+            auto eq = eqs[i];
+            expr_ptr local = make<value>(0), nonlocal = make<value>(0);
+            split_pointwise(*simplify(*(eq->lhs - eq->rhs)), local, nonlocal);
+
+            auto v = as<value>(*nonlocal);
+            if (!v || v->val != 0) {
+                os << "\n    sym eq_" << eq->name << " = ";
+                emit_symbolic_expr(os, *nonlocal);
+                os << ";\n";
+
+                tape t;
+                t.record(*nonlocal);
+                for (auto sym: get_vars(t)) {
+                    // zero blocks are not assembled
+                    if (!pattern[i][var_index[sym]]) continue;
+                    if (!is_unknown(sym)) continue;
+                    os << "    eq_" << eq->name << ".add(op, \""
+                        << eq->name << "\", \"" << name_of(sym) << "\");\n";
+                }
+            }
+
+            tape t;
+            t.record(*local);
+            for (auto sym: get_vars(t)) {
+                if (!pattern[i][var_index[sym]]) continue;
+                if (!is_unknown(sym)) continue;
+                expr_ptr c = der.derivative(*local, sym);
+                auto v = as<value>(*c);
+                if (v && v->val == 0) continue;
+
+                std::string var = name_of(sym);
+                std::ostringstream body;
+                kernel_args args;
+                emit_pointwise(body, *c, expr_map<std::string>(), args);
+                std::string kernel = "jacobian_" + eq->name + "_" + var;
+                define_kernel(kernel, "coefficient of " + var
+                        + " in the jacobian of equation " + eq->name,
+                        body.str(), args);
+
+                std::string m = "jac_" + eq->name + "_" + var;
+                os << "    matrix " << m
+                    << "(map.r.nrows(), map.r.ncols());\n";
+                emit_kernel_call(jac.concurrent ? jac.local : os, kernel, m,
+                        args);
+                (jac.concurrent ? jac.commit : os) << "    op->add_d(\""
+                    << eq->name << "\", \"" << var << "\", " << m << ");\n";
+            }
+        }
+
+        /// \brief Adds the terms of sum `e' to `local' if they are pointwise,
+        /// to `nonlocal' otherwise
+        void split_pointwise(const expr& e, expr_ptr& local,
+                expr_ptr& nonlocal) {
+            // the sum is recorded once, operands come first in the tape
+            tape t;
+            t.record(e);
+            std::vector<bool> pointwise(t.size());
+            for (tape::index i=0; i<t.size(); i++) {
+                pointwise[i] = is_pointwise_node(t, i);
+                for (size_t j=0; j<t.n_operands(i) && pointwise[i]; j++)
+                    pointwise[i] = pointwise[t.operand(i, j)];
+            }
+            for (auto& term: sum_terms(e)) {
+                expr_ptr& sum = pointwise[t.record(*term.first)] ?
+                    local : nonlocal;
+                sum = simplify_bin(sum, term.second ? '-' : '+', term.first);
+            }
+        }
+
+        /// \brief Tells if entry `i' of `t' is no differential operator and
+        /// no unknown other than a field: the jacobian blocks of an
+        /// expression made of such nodes are diagonal
+        bool is_pointwise_node(const tape& t, tape::index i) {
+            switch (t.kind(i)) {
+                case LAP_EXPR:
+                case DIFF_EXPR:
+                case GRAD_EXPR:
+                case DIV_EXPR:
+                case DELTA:
+                case FIELD_VALUE:
+                    return false;
+                case IDENTIFIER:
+                    // the block of a real unknown is a column
+                    return !is_unknown(t.sym(i))
+                        || vars[var_index[t.sym(i)]]->type != REAL;
+                default:
+                    return true;
+            }
+        }
+
+        /// \brief Writes the members of a block used by the Newton driver
+        /// to apply a damped correction and measure its convergence
+        void emit_newton_step(std::ostream& os, const std::string& name,
+                const std::vector<size_t>& block) {
+            os << "void " << name << "::start_step() {\n";
+            for (auto var: block_vars) {
+                os << "    " << var->name << "_0 = " << var->name << ";\n";
+                os << "    d_" << var->name << " = ";
+                if (var->type == REAL)
+                    os << "ones(1, 1)*op->get_var(\"" << var->name
+                        << "\")(0);\n";
+                else
+                    os << "op->get_var(\"" << var->name << "\");\n";
+            }
+            os << "}\n\n";
+
+            os << "void " << name << "::step(double lambda) {\n";
+            for (auto var: block_vars) {
+                os << "    " << var->name << " = " << var->name
+                    << "_0 + lambda*d_" << var->name << ";\n";
+            }
+            os << "}\n\n";
+
+            os << "double " << name << "::correction() {\n";
+            os << "    double e = 0.;\n";
+            for (auto var: block_vars) {
+                os << "    e = std::max(e, max(abs(d_" << var->name
+                    << ")));\n";
+            }
+            os << "    return e;\n";
+            os << "}\n\n";
+
+            os << "double " << name << "::residual() {\n";
+            os << "    double r = 0.;\n";
+            for (auto i: block) {
+                os << "    r = std::max(r, max(abs(op->get_rhs(\""
+                    << eqs[i]->name << "\"))));\n";
+            }
+            os << "    return r;\n";
+            os << "}\n\n";
         }
 
-        void emit_rhs(std::ostream& os, const equation& eq) {
-            os << "    matrix rhs = -eq_" << eq.name << ".eval();\n";
+        void emit_rhs(rhs_code& rhs, const equation& eq) {
+            emit_residual(rhs, eq.name, *simplify(*(eq.lhs - eq.rhs)));
 
             // Fix rhs at BC
+            std::ostream& os = rhs.local;
             int n_top_bc = 0;
             int n_bot_bc = 0;
             for (auto bc: eq.bcs) {
@@ -156,20 +735,16 @@ class solver {
                     case CENTER:
                     case BOTTOM:
                         n_bot_bc++;
-                        os << "    rhs(0) = -(";
-                        if (bc->eq.rhs == value(0))
-                            emit_eval_expr(os, bc->eq.lhs);
-                        else
-                            emit_eval_expr(os, bc->eq.lhs-bc->eq.rhs);
+                        os << "    rhs_" << eq.name << "(0) = -(";
+                        emit_eval_expr(os,
+                                *simplify(*(bc->eq.lhs-bc->eq.rhs)));
                         os << ")(0);\n";
                         break;
                     case SURFACE:
                     case TOP:
-                        os << "    rhs(-1) = -(";
-                        if (bc->eq.rhs == value(0))
-                            emit_eval_expr(os, bc->eq.lhs);
-                        else
-                            emit_eval_expr(os, bc->eq.lhs-bc->eq.rhs);
+                        os << "    rhs_" << eq.name << "(-1) = -(";
+                        emit_eval_expr(os,
+                                *simplify(*(bc->eq.lhs-bc->eq.rhs)));
                         os << ")(-1);\n";
                         n_top_bc++;
                         break;
@@ -181,87 +756,313 @@ class solver {
                 error("Too many BC imposed on equation " + eq.name);
             }
 
-            os << "    op->set_rhs(\"" << eq.name << "\", rhs);\n";
+            rhs.commit << "    op->set_rhs(\"" << eq.name << "\", rhs_"
+                << eq.name << ");\n";
         }
 
-        void emit_eval_expr(std::ostream& os, const expr& expr) {
-            if (auto id = dynamic_cast<const identifier *>(&expr)) {
-                os << id->name;
-            }
-            else if (auto be = dynamic_cast<const bin_expr *>(&expr)) {
-                os << "(";
-                emit_eval_expr(os, be->lhs);
-                os << ")";
-                os << be->op;
-                os << "(";
-                emit_eval_expr(os, be->rhs);
-                os << ")";
-            }
-            else if (auto ue = dynamic_cast<const unary_expr *>(&expr)) {
-                if (ue->op == '-') {
-                    os << "-(";
-                    emit_eval_expr(os, ue->expr);
-                    os << ")";
+        /// \brief Writes `rhs', minus the residual `e' of equation `name'
+        ///
+        /// Non-local terms (derivatives) are evaluated first with the library
+        /// operators, the pointwise rest of the residual is then evaluated by
+        /// a kernel looping over the grid points, without walking a symbolic
+        /// tree nor allocating a matrix per operation. Kernels work on raw
+        /// arrays so that the loop can be vectorized (see simd.hpp).
+        void emit_residual(rhs_code& rhs, const std::string& name,
+                const expr& e) {
+            std::ostream& os = rhs.serial;
+            if (!is_field(e)) {
+                begin_rhs(rhs, name);
+                rhs.local << "-(";
+                emit_expr(rhs.local, e);
+                rhs.local << ")*ones(1, 1);\n";
+                return;
+            }
+
+            std::vector<expr_ptr> terms;
+            find_nonlocal(e, terms);
+            expr_map<std::string> nonlocal;
+            for (auto t: terms) {
+                if (nonlocal.count(t)) continue;
+                std::string nl = "nl_" + name + "_"
+                    + std::to_string(nonlocal.size());
+                nonlocal[t] = nl;
+                os << "    matrix " << nl << " = ";
+                if (t->kind == LAP_EXPR) {
+                    // the laplacian is only implemented by symbolic objects
+                    emit_symbolic_expr(os, *t);
+                    os << ".eval()";
                 }
                 else {
-                    error("Unknown unary operator `"
-                            + std::to_string(ue->op)
-                            + "\'");
+                    emit_expr(os, *t);
                 }
+                os << ";\n";
+            }
+
+            std::ostringstream body;
+            kernel_args args;
+            emit_pointwise(body, e, nonlocal, args);
+
+            std::string kernel = "residual_" + name;
+            define_kernel(kernel, "pointwise part of the residual of equation "
+                    + name, "-(" + body.str() + ")", args);
+
+            std::string r = "rhs_" + name;
+            os << "    matrix " << r << "(map.r.nrows(), map.r.ncols());\n";
+            emit_kernel_call(rhs.local, kernel, r, args);
+        }
+
+        /// \brief Defines kernel `kernel' (once per block), which writes
+        /// `value' at each grid point
+        void define_kernel(const std::string& kernel,
+                const std::string& comment, const std::string& value,
+                const kernel_args& args) {
+            if (kernels.count(kernel)) return;
+            std::ostringstream def;
+            def << "// " << comment << "\n";
+            def << "ESTER_KERNEL\n";
+            def << "static void " << kernel << "(int npts, double *out";
+            for (auto& arg: args) {
+                def << ", " << (arg.second ? "const double *" : "double ")
+                    << arg.first;
             }
-            else if (auto de = dynamic_cast<const diff_expr *>(&expr)) {
-                if (de->id.name == "r") {
-                    os << "(map.D, ";
-                    emit_eval_expr(os, de->expr);
-                    os << ")";
+            def << ") {\n";
+            def << "    ESTER_SIMD\n";
+            def << "    for (int ipt=0; ipt<npts; ipt++)\n";
+            def << "        out[ipt] = " << value << ";\n";
+            def << "}\n\n";
+            kernels[kernel] = def.str();
+        }
+
+        /// \brief Writes the call of `kernel' filling matrix `out'
+        void emit_kernel_call(std::ostream& os, const std::string& kernel,
+                const std::string& out, const kernel_args& args) {
+            os << "    " << kernel << "(" << out << ".nrows()*" << out
+                << ".ncols(), " << out << ".data()";
+            for (auto& arg: args) {
+                os << ", " << arg.first;
+                if (arg.second) {
+                    os << ".data()";
                 }
                 else {
-                    TODO;
+                    // real variables and scalar temporaries are 1x1 matrices
+                    symbol sym;
+                    if (!context::current().symbols().find(arg.first, sym)
+                            || !is_param(sym))
+                        os << "(0)";
                 }
             }
-            else {
-                expr.display("Term skipped");
-                error("Term skipped...");
+            os << ");\n";
+        }
+
+        /// \brief Tells if `e' has one value per grid point, scalars are 1x1
+        /// matrices or doubles
+        bool is_field(const expr& e) {
+            switch (e.kind) {
+                case VALUE:
+                case DELTA:
+                case FIELD_VALUE:
+                    return false;
+                case IDENTIFIER:
+                    return is_field_id(static_cast<const identifier&>(e).sym);
+                case BIN_EXPR:
+                case UNARY_EXPR:
+                case FUNC:
+                    break;
+                default:
+                    return true;
             }
+            // an expression is a field if one of its leaves or operators is
+            tape t;
+            t.record(e);
+            for (tape::index i=0; i<t.size(); i++) {
+                switch (t.kind(i)) {
+                    case IDENTIFIER:
+                        if (is_field_id(t.sym(i))) return true;
+                        break;
+                    case LAP_EXPR:
+                    case DIFF_EXPR:
+                    case GRAD_EXPR:
+                    case DIV_EXPR:
+                        return true;
+                    default:
+                        break;
+                }
+            }
+            return false;
         }
 
-        int need_value_at(const expr& expr) {
-            if (auto fv = dynamic_cast<const field_value *>(&expr)) {
-                if (auto index = dynamic_cast<const value *>(&fv->index)) {
-                    if (index->val == 0) {
-                        return BOTTOM;
+        bool is_field_id(symbol sym) {
+            if (is_var(sym))
+                return vars[var_index[sym]]->type == FIELD;
+            // matrix parameters are assumed to be fields
+            return is_param(sym) && params[name_of(sym)] != "double";
+        }
+
+        /// \brief Collects the outermost differential operators of `e'
+        void find_nonlocal(const expr& e, std::vector<expr_ptr>& terms) {
+            // operands are pushed last first to keep the order of the terms
+            std::vector<expr_ptr> stack(1, &e);
+            while (!stack.empty()) {
+                const ir::expr& t = *stack.back();
+                stack.pop_back();
+                if (is_temp(t, false)) continue;
+                switch (t.kind) {
+                    case LAP_EXPR:
+                    case DIFF_EXPR:
+                    case GRAD_EXPR:
+                    case DIV_EXPR:
+                        terms.push_back(&t);
+                        break;
+                    case BIN_EXPR: {
+                        auto& be = static_cast<const bin_expr&>(t);
+                        stack.push_back(&be.rhs);
+                        stack.push_back(&be.lhs);
+                        break;
                     }
-                    if (index->val == 1) {
-                        return TOP;
+                    case UNARY_EXPR:
+                        stack.push_back(&static_cast<const unary_expr&>(t).expr);
+                        break;
+                    case FUNC: {
+                        auto& args = static_cast<const func&>(t).args;
+                        stack.insert(stack.end(), args.rbegin(), args.rend());
+                        break;
                     }
+                    default:
+                        break;
                 }
-                TODO;
             }
-            else if (auto be = dynamic_cast<const bin_expr *>(&expr)) {
-                int l = need_value_at(be->lhs);
-                int r = need_value_at(be->rhs);
-                if (l == -1) return r;
-                if (r == -1) return l;
-                if (r == l) return r;
-                error("Value of field need at 2 different locations");
+        }
+
+        /// \brief Writes the value of `e' at grid point `ipt' in a kernel,
+        /// the arrays and scalars it reads are added to `args'
+        void emit_pointwise(std::ostream& os, const expr& e,
+                const expr_map<std::string>& nonlocal, kernel_args& args) {
+            write_pieces(os, std::vector<piece>(1, piece(&e)),
+                    [&](const ir::expr& t, std::vector<piece>& out) {
+                        pointwise_pieces(t, nonlocal, args, out);
+                    });
+        }
+
+        void pointwise_pieces(const expr& e,
+                const expr_map<std::string>& nonlocal, kernel_args& args,
+                std::vector<piece>& out) {
+            auto it = temps[0].find(&e);
+            if (it != temps[0].end()) {
+                used_temps[0].insert(&e);
+                out.push_back(kernel_arg(it->second, is_field(e), args));
+                return;
             }
-            else if (dynamic_cast<const identifier *>(&expr)) {
-                return -1;
+            auto nl = nonlocal.find(&e);
+            if (nl != nonlocal.end()) {
+                out.push_back(kernel_arg(nl->second, true, args));
+                return;
             }
-            else if (dynamic_cast<const value *>(&expr)) {
-                return -1;
+            switch (e.kind) {
+                case VALUE:
+                    out.push_back(value_text(static_cast<const value&>(e).val));
+                    break;
+                case IDENTIFIER: {
+                    auto& id = static_cast<const identifier&>(e);
+                    if (!is_param(id.sym) && !is_var(id.sym))
+                        error("Undefined identifier " + id.name);
+                    out.push_back(kernel_arg(id.name, is_field(e), args));
+                    break;
+                }
+                case BIN_EXPR: {
+                    auto& be = static_cast<const bin_expr&>(e);
+                    auto lhs = bin_term(be.lhs, false);
+                    bool lp = lhs && lhs->precedence < be.precedence;
+                    auto rhs = bin_term(be.rhs, false);
+                    bool rp = (rhs && rhs_needs_parens(be, *rhs))
+                        || (be.rhs.kind == UNARY_EXPR
+                                && !is_temp(be.rhs, false));
+                    if (lp) out.push_back(std::string("("));
+                    out.push_back(&be.lhs);
+                    out.push_back(std::string(lp ? ")" : "") + be.op
+                            + (rp ? "(" : ""));
+                    out.push_back(&be.rhs);
+                    if (rp) out.push_back(std::string(")"));
+                    break;
+                }
+                case UNARY_EXPR: {
+                    auto& ue = static_cast<const unary_expr&>(e);
+                    bool p = !is_temp(ue.expr, false)
+                        && (ue.expr.kind == UNARY_EXPR
+                                || ue.expr.kind == BIN_EXPR);
+                    out.push_back(std::string(1, ue.op) + (p ? "(" : ""));
+                    out.push_back(&ue.expr);
+                    if (p) out.push_back(std::string(")"));
+                    break;
+                }
+                case FUNC: {
+                    auto& f = static_cast<const func&>(e);
+                    out.push_back(f.name + "(");
+                    for (size_t i=0; i<f.args.size(); i++) {
+                        if (i > 0) out.push_back(std::string(", "));
+                        out.push_back(f.args[i]);
+                    }
+                    out.push_back(std::string(")"));
+                    break;
+                }
+                default:
+                    e.display("Term skipped");
+                    error("Term skipped");
             }
-            else {
-                expr.display();
-                TODO;
+        }
+
+        std::string kernel_arg(const std::string& name, bool field,
+                kernel_args& args) {
+            auto arg = std::make_pair(name, field);
+            if (std::find(args.begin(), args.end(), arg) == args.end())
+                args.push_back(arg);
+            return field ? name + "[ipt]" : name;
+        }
+
+        void emit_eval_expr(std::ostream& os, const expr& expr) {
+            emit_expr(os, expr);
+        }
+
+        int need_value_at(const expr& expr) {
+            int loc = -1;
+            tape t;
+            t.record(expr);
+            for (tape::index i=0; i<t.size(); i++) {
+                switch (t.kind(i)) {
+                    case FIELD_VALUE: {
+                        int l = -1;
+                        auto& fv = static_cast<const field_value&>(*t.node(i));
+                        if (auto index = as<value>(fv.index)) {
+                            if (index->val == 0) {
+                                l = BOTTOM;
+                            }
+                            if (index->val == 1) {
+                                l = TOP;
+                            }
+                        }
+                        if (l == -1) TODO;
+                        if (loc != -1 && loc != l)
+                            error("Value of field need at 2 different locations");
+                        loc = l;
+                        break;
+                    }
+                    case BIN_EXPR:
+                    case IDENTIFIER:
+                    case DELTA:
+                    case VALUE:
+                        break;
+                    default:
+                        expr.display();
+                        TODO;
+                }
             }
-            return -1;
+            return loc;
         }
 
-        void emit_eq_in_bc(std::ostream& os, const equation& eq) {
-            const expr& e = eq.lhs - eq.rhs;
-            auto dexpr = func_der(e);
-            int loc = need_value_at(e);
+        void emit_eq_in_bc(std::ostream& os, rhs_code& rhs,
+                const equation& eq) {
+            expr_ptr e = simplify(*(eq.lhs - eq.rhs));
+            auto dexpr = func_der(*e);
+            int loc = need_value_at(*e);
             switch (loc) {
                 case CENTER:
                 case BOTTOM:
@@ -278,76 +1079,45 @@ class solver {
                 default:
                     error("Unknown BC " + std::to_string(loc));
             }
-            emit_bc_expr(os, eq.name, loc, *dexpr);
+            if (assemble)
+                emit_bc_expr(os, eq.name, loc, *dexpr);
 
-            os << "\n    // RHS\n";
-            os << "    op->set_rhs(\""
-                << eq.name << "\", -(";
-            emit_expr(os, eq.lhs - eq.rhs);
-            os << ")"; 
+            begin_rhs(rhs, eq.name);
+            rhs.local << "-(";
+            emit_expr(rhs.local, *e);
+            rhs.local << ")";
             switch (loc) {
                 case CENTER:
                 case BOTTOM:
-                    os << "(0)*ones(1, 1)";
+                    rhs.local << "(0)*ones(1, 1)";
                     break;
                 case SURFACE:
                 case TOP:
-                    os << "(-1)*ones(1, 1)";
+                    rhs.local << "(-1)*ones(1, 1)";
                     break;
             }
-            os << ");\n";
+            rhs.local << ";\n";
+            rhs.commit << "    op->set_rhs(\"" << eq.name << "\", rhs_"
+                << eq.name << ");\n";
         }
 
         /// \brief calculates the functional derivative of the expression
         /// provided as argument
-        std::shared_ptr<const expr> func_der(const expr& e) {
-            if (auto be = dynamic_cast<const bin_expr *>(&e)) {
-                auto dlhs = func_der(be->lhs);
-                auto drhs = func_der(be->rhs);
-                switch (be->op) {
-                    case '+':
-                        if (*drhs == value(0)) return dlhs;
-                        if (*dlhs == value(0)) return drhs;
-                        return std::make_shared<const bin_expr>(dlhs, '+', drhs);
-                        break;
-                    case '-':
-                        if (*drhs == value(0)) return dlhs;
-                        if (*dlhs == value(0))
-                            return std::make_shared<const unary_expr>('-', drhs);
-                        return std::make_shared<const bin_expr>(dlhs, '-', drhs);
-                        break;
-                    case '*':
-                        return std::make_shared<const bin_expr>(
-                                std::make_shared<const bin_expr>(
-                                    dlhs, '*', be->rhs.copy())
-                                , '+', 
-                                std::make_shared<const bin_expr>(
-                                    be->lhs.copy(), '*', drhs)
-                                );
-                        break;
-                    default:
-                        TODO;
-                }
-            }
-            else if (auto id = dynamic_cast<const identifier *>(&e)) {
-                return std::make_shared<const delta>(id->name);
-            }
-            else if (dynamic_cast<const value *>(&e)) {
-                return std::make_shared<const value>(0);
-            }
-            else {
-                TODO;
-            }
+        expr_ptr func_der(const expr& e) {
+            return der.linearize(e);
         }
 
         bool contains_delta(const expr& expr) {
-            if (dynamic_cast<const delta *>(&expr)) return true;
-            else if (auto be = dynamic_cast<const bin_expr *>(&expr)) {
-                return contains_delta(be->lhs)
-                    && contains_delta(be->rhs);
-            }
-            else {
-                TODO;
+            switch (expr.kind) {
+                case DELTA:
+                    return true;
+                case BIN_EXPR: {
+                    auto& be = static_cast<const bin_expr&>(expr);
+                    return contains_delta(be.lhs)
+                        && contains_delta(be.rhs);
+                }
+                default:
+                    TODO;
             }
         }
 
@@ -370,53 +1140,64 @@ class solver {
                 default:
                     error("Unknown BC " + std::to_string(bc_loc));
             }
-            if (auto d = dynamic_cast<const delta *>(&expr)) {
-                std::string factor;
-                if (neg) factor = "-ones(1, 1)";
-                else factor = "ones(1, 1)";
-                os << "    op->" << bc_func_name << "(0, \"" << eq_name
-                    << "\", \"" << d->name << "\", " << factor << ");\n";
-            }
-            else if (auto be = dynamic_cast<const bin_expr *>(&expr)) {
-                switch (be->op) {
-                    case '+':
-                        emit_bc_expr(os, eq_name, bc_loc, be->lhs, neg);
-                        emit_bc_expr(os, eq_name, bc_loc, be->rhs, neg);
-                        break;
-                    case '-':
-                        emit_bc_expr(os, eq_name, bc_loc, be->lhs, neg);
-                        emit_bc_expr(os, eq_name, bc_loc, be->rhs, !neg);
+            // sums are flattened without recursion
+            for (auto& t: sum_terms(expr)) {
+                emit_bc_expr_term(os, bc_func_name, loc_index, eq_name,
+                        bc_loc, *t.first, neg != t.second);
+            }
+        }
+
+        void emit_bc_expr_term(std::ostream& os,
+                const std::string& bc_func_name,
+                const std::string& loc_index, const std::string& eq_name,
+                int bc_loc, const expr& expr, bool neg) {
+            switch (expr.kind) {
+                case DELTA: {
+                    // known variables only contribute to the RHS
+                    if (!is_unknown(static_cast<const delta&>(expr).sym))
                         break;
-                    case '*':
-                        if (auto d = dynamic_cast<const delta *>(&be->lhs)) {
-                            os << "    op->" << bc_func_name << "(0, \""
-                                << eq_name << "\", \""
-                                << d->name << "\", (";
-                            if (neg) emit_expr(os, -be->rhs);
-                            else emit_expr(os, be->rhs);
-                            os << ")(" << loc_index << ")*ones(1, 1));\n";
-                        }
-                        else if (auto d = dynamic_cast<const delta *>(&be->rhs)) {
-                            os << "    op->" << bc_func_name << "(0, \""
-                                << eq_name << "\", \""
-                                << d->name << "\", (";
-                            if (neg) emit_expr(os, -be->lhs);
-                            else emit_expr(os, be->lhs);
-                            os << ")(" << loc_index << ")*ones(1, 1));\n";
-                        }
-                        else {
-                            if (auto rbe = dynamic_cast<const bin_expr *>(&be->rhs)) {
+                    std::string factor;
+                    if (neg) factor = "-ones(1, 1)";
+                    else factor = "ones(1, 1)";
+                    os << "    op->" << bc_func_name << "(0, \"" << eq_name
+                        << "\", \"" << static_cast<const delta&>(expr).name
+                        << "\", " << factor << ");\n";
+                    break;
+                }
+                case BIN_EXPR: {
+                    auto be = static_cast<const bin_expr *>(&expr);
+                    switch (be->op) {
+                        case '*':
+                            if (auto d = as<delta>(be->lhs)) {
+                                if (!is_unknown(d->sym)) break;
+                                os << "    op->" << bc_func_name << "(0, \""
+                                    << eq_name << "\", \""
+                                    << d->name << "\", (";
+                                if (neg) emit_expr(os, *(-be->rhs));
+                                else emit_expr(os, be->rhs);
+                                os << ")(" << loc_index << ")*ones(1, 1));\n";
+                            }
+                            else if (auto d = as<delta>(be->rhs)) {
+                                if (!is_unknown(d->sym)) break;
+                                os << "    op->" << bc_func_name << "(0, \""
+                                    << eq_name << "\", \""
+                                    << d->name << "\", (";
+                                if (neg) emit_expr(os, *(-be->lhs));
+                                else emit_expr(os, be->lhs);
+                                os << ")(" << loc_index << ")*ones(1, 1));\n";
+                            }
+                            else if (auto rbe = as<bin_expr>(be->rhs)) {
                                 if (rbe->op == '+') {
                                     emit_bc_expr(os, eq_name, bc_loc,
-                                            be->lhs*rbe->lhs, neg);
+                                            *(be->lhs*rbe->lhs), neg);
                                     emit_bc_expr(os, eq_name, bc_loc,
-                                            be->lhs*rbe->rhs, neg);
+                                            *(be->lhs*rbe->rhs), neg);
                                 }
                                 else if (rbe->op == '-') {
                                     emit_bc_expr(os, eq_name, bc_loc,
-                                            be->lhs*rbe->lhs, neg);
+                                            *(be->lhs*rbe->lhs), neg);
                                     emit_bc_expr(os, eq_name, bc_loc,
-                                            be->lhs*rbe->rhs, !neg);
+                                            *(be->lhs*rbe->rhs), !neg);
                                 }
                                 else {
                                     TODO;
@@ -425,25 +1206,15 @@ class solver {
                             else {
                                 TODO;
                             }
-                        }
-                        break;
-                    default:
-                        TODO;
-                }
-            }
-            else {
-                TODO;
-            }
-        }
-
-        void emit_eq(std::ostream& os, std::shared_ptr<const ir::equation> eq) {
-            if (auto rhs = dynamic_cast<const unary_expr *>(&eq->rhs)) {
-                if (rhs->op == '-') {
-                    emit_symbolic_expr(os, eq->lhs + rhs->expr);
-                    return;
+                            break;
+                        default:
+                            TODO;
+                    }
+                    break;
                 }
+                default:
+                    TODO;
             }
-            emit_symbolic_expr(os, eq->lhs - eq->rhs);
         }
 
         void emit_symbolic_expr(std::ostream& os, const expr& expr) {
@@ -453,164 +1224,361 @@ class solver {
         /// \brief write expression `expr' to the outpur stream. If `symbolic'
         /// is true writes the symbolic version of the expression. Otherwise
         // writes the matrix (value) expression
-#define PRETTY_EXPR
         void emit_expr(std::ostream& os, const expr& expr, bool symbolic = false) {
-            const ir::expr *e = &expr;
-            if (auto be = dynamic_cast<const bin_expr *>(e)) {
-#ifdef PRETTY_EXPR
-                if (auto lhs = dynamic_cast<const bin_expr *>(&be->lhs))
-                    if (lhs->precedence < be->precedence)
-                        os << "(";
-#else
-                os << "(";
-#endif
-                emit_expr(os, be->lhs, symbolic);
-#ifdef PRETTY_EXPR
-                if (auto lhs = dynamic_cast<const bin_expr *>(&be->lhs))
-                    if (lhs->precedence < be->precedence)
-                        os << ")";
-#else
-                os << ")";
-#endif
-                os << be->op;
-#ifdef PRETTY_EXPR
-                if (auto rhs = dynamic_cast<const bin_expr *>(&be->rhs))
-                    if (rhs->precedence < be->precedence)
-                        os << "(";
-                if (dynamic_cast<const unary_expr *>(&be->rhs))
-                    os << "(";
-#else
-                os << "(";
-#endif
-                emit_expr(os, be->rhs, symbolic);
-#ifdef PRETTY_EXPR
-                if (auto rhs = dynamic_cast<const bin_expr *>(&be->rhs))
-                    if (rhs->precedence < be->precedence)
-                        os << ")";
-                if (dynamic_cast<const unary_expr *>(&be->rhs))
-                    os << ")";
-#else
-                os << ")";
-#endif
+            if (collecting) cse_roots[symbolic].push_back(&expr);
+            emit_term(os, expr, symbolic);
+        }
+
+        /// \brief Writes a sub-expression: its temporary if it has one, the
+        /// expression itself otherwise
+        void emit_term(std::ostream& os, const expr& expr, bool symbolic) {
+            write_pieces(os, std::vector<piece>(1, piece(&expr)),
+                    [&](const ir::expr& e, std::vector<piece>& out) {
+                        term_pieces(e, symbolic, out);
+                    });
+        }
+
+        void term_pieces(const expr& expr, bool symbolic,
+                std::vector<piece>& out) {
+            auto it = temps[symbolic].find(&expr);
+            if (it != temps[symbolic].end()) {
+                used_temps[symbolic].insert(&expr);
+                out.push_back(it->second);
             }
-            else if (auto ue = dynamic_cast<const unary_expr *>(e)) {
-                os << ue->op;
+            else {
+                node_pieces(expr, symbolic, out);
+            }
+        }
+
+        /// \brief Finds the sub-expressions that would be written more than
+        /// once (value numbering is given by hash-consing) and names them
+        void find_temporaries(bool symbolic) {
+            tape t;
+            std::vector<size_t> uses;
+            for (auto e: cse_roots[symbolic]) {
+                tape::index i = t.record(*e);
+                uses.resize(t.size(), 0);
+                uses[i]++;
+            }
+
+            // parents come after their operands in the tape: going backward
+            // gives the final number of uses of each node
+            std::vector<expr_ptr> shared;
+            for (tape::index i=t.size(); i-- > 0; ) {
+                size_t n = uses[i];
+                if (n == 0) continue;
+                if (n > 1 && !is_cheap(t, i)) {
+                    shared.push_back(t.node(i));
+                    n = 1;
+                }
+                for (size_t j=0; j<t.n_operands(i); j++)
+                    uses[t.operand(i, j)] += n;
+            }
+
+            // operands are defined before the temporaries using them
+            for (auto it = shared.rbegin(); it != shared.rend(); ++it) {
+                temps[symbolic][*it] = "cse_" + std::to_string(n_temps());
+                temp_defs[symbolic].push_back(*it);
+            }
+        }
+
+        bool is_temp(const expr& e, bool symbolic) {
+            return temps[symbolic].count(&e) > 0;
+        }
+
+        /// \brief Returns `e' as a binary expression if it is written as such
+        const bin_expr *bin_term(const expr& e, bool symbolic) {
+            if (is_temp(e, symbolic)) return NULL;
+            return as<bin_expr>(e);
+        }
+
+        bool is_cheap(const tape& t, tape::index i) {
+            switch (t.kind(i)) {
+                case VALUE:
+                case IDENTIFIER:
+                case DELTA:
+                case FIELD_VALUE:
+                    return true;
+                case UNARY_EXPR:
+                    return is_cheap(t, t.operand(i, 0));
+                default:
+                    return false;
+            }
+        }
+
+        size_t n_temps() const {
+            return temps[0].size() + temps[1].size();
+        }
+
+        /// \brief Defines the temporaries in `used_temps' and those their
+        /// definitions use: update_rhs() only computes the temporaries of
+        /// the RHS
+        void emit_temporaries(std::ostream& os) {
+            // a definition only uses temporaries defined before it: going
+            // backward, each one is marked used before its definition
+            std::vector<std::string> defs;
+            for (int symbolic=0; symbolic<2; symbolic++) {
+                auto& d = temp_defs[symbolic];
+                for (auto it = d.rbegin(); it != d.rend(); ++it) {
+                    if (!used_temps[symbolic].count(*it)) continue;
+                    std::ostringstream def;
+                    def << "    " << (symbolic ? "sym " : "matrix ")
+                        << temps[symbolic][*it] << " = ";
+                    emit_node(def, **it, symbolic);
+                    def << ";\n";
+                    defs.push_back(def.str());
+                }
+            }
+            if (defs.empty()) return;
+            os << "\n    // common subexpressions\n";
+            for (auto it = defs.rbegin(); it != defs.rend(); ++it)
+                os << *it;
+        }
+
+#define PRETTY_EXPR
+        /// \brief Writes expression `expr' itself, even if it has a temporary
+        void emit_node(std::ostream& os, const expr& expr, bool symbolic) {
+            std::vector<piece> pieces;
+            node_pieces(expr, symbolic, pieces);
+            write_pieces(os, pieces,
+                    [&](const ir::expr& e, std::vector<piece>& out) {
+                        term_pieces(e, symbolic, out);
+                    });
+        }
+
+        void node_pieces(const expr& expr, bool symbolic,
+                std::vector<piece>& out) {
+            switch (expr.kind) {
+                case BIN_EXPR: {
+                    auto be = static_cast<const bin_expr *>(&expr);
 #ifdef PRETTY_EXPR
-                if (dynamic_cast<const unary_expr *>(&ue->expr)
-                        || dynamic_cast<const bin_expr *>(&ue->expr))
-                    os << '(';
+                    auto lhs = bin_term(be->lhs, symbolic);
+                    bool lp = lhs && lhs->precedence < be->precedence;
+                    auto rhs = bin_term(be->rhs, symbolic);
+                    bool rp = (rhs && rhs_needs_parens(*be, *rhs))
+                        || (be->rhs.kind == UNARY_EXPR
+                                && !is_temp(be->rhs, symbolic));
 #else
-                os << "(";
+                    bool lp = true, rp = true;
 #endif
-                emit_expr(os, ue->expr, symbolic);
+                    if (lp) out.push_back(std::string("("));
+                    out.push_back(&be->lhs);
+                    out.push_back(std::string(lp ? ")" : "") + be->op
+                            + (rp ? "(" : ""));
+                    out.push_back(&be->rhs);
+                    if (rp) out.push_back(std::string(")"));
+                    break;
+                }
+                case UNARY_EXPR: {
+                    auto ue = static_cast<const unary_expr *>(&expr);
 #ifdef PRETTY_EXPR
-                if (dynamic_cast<const unary_expr *>(&ue->expr)
-                        || dynamic_cast<const bin_expr *>(&ue->expr))
-                    os << ')';
+                    bool p = !is_temp(ue->expr, symbolic)
+                        && (ue->expr.kind == UNARY_EXPR
+                                || ue->expr.kind == BIN_EXPR);
 #else
-                os << ")";
+                    bool p = true;
 #endif
-            }
-            else if (auto val = dynamic_cast<const value *>(e)) {
-                os << val->val;
-            }
-            else if (auto id = dynamic_cast<const identifier *>(e)) {
-                if (symbolic && is_var(id->name)) {
-                    os << "sym_" << id->name;
+                    out.push_back(std::string(1, ue->op) + (p ? "(" : ""));
+                    out.push_back(&ue->expr);
+                    if (p) out.push_back(std::string(")"));
+                    break;
                 }
-                else {
-                    if (is_param(id->name) || is_var(id->name))
-                        os << id->name;
+                case VALUE:
+                    out.push_back(value_text(
+                                static_cast<const value&>(expr).val));
+                    break;
+                case IDENTIFIER:
+                case DELTA:
+                case FIELD_VALUE: {
+                    auto id = static_cast<const identifier *>(&expr);
+                    if (symbolic && is_unknown(id->sym)) {
+                        out.push_back("sym_" + id->name);
+                    }
                     else {
-                        error("Undefined identifier " + id->name);
+                        if (is_param(id->sym) || is_var(id->sym))
+                            out.push_back(id->name);
+                        else {
+                            error("Undefined identifier " + id->name);
+                        }
                     }
+                    break;
                 }
-            }
-            else if (auto lap = dynamic_cast<const lap_expr *>(e)) {
-                os << "lap(";
-                emit_expr(os, lap->expr, symbolic);
-                os << ")";
-            }
-            else if (auto f = dynamic_cast<const func *>(e)) {
-                if (f->name == "pow"
-                        || f->name == "sin"
-                        || f->name == "cos") {
-                    os << f->name << "(";
-                    int i = 0;
-                    for (auto arg: f->args) {
-                        if (i > 0)
-                            os << ", ";
-                        emit_expr(os, *arg, symbolic);
-                        i++;
+                case LAP_EXPR:
+                    out.push_back(std::string("lap("));
+                    out.push_back(&static_cast<const lap_expr&>(expr).expr);
+                    out.push_back(std::string(")"));
+                    break;
+                case DIFF_EXPR: {
+                    auto& de = static_cast<const diff_expr&>(expr);
+                    if (symbolic) {
+                        expr.display("Term skipped");
+                        error("Term skipped");
                     }
-                    os << ")";
+                    if (de.id.name == "r") {
+                        out.push_back(std::string("(map.D, "));
+                        out.push_back(&de.expr);
+                        out.push_back(std::string(")"));
+                    }
+                    else {
+                        TODO;
+                    }
+                    break;
                 }
-                else {
-                    error(std::string("function ") + f->name + " not yet handled\n");
+                case FUNC: {
+                    auto f = static_cast<const func *>(&expr);
+                    if (f->name == "pow"
+                            || f->name == "sin"
+                            || f->name == "cos"
+                            || f->name == "exp"
+                            || f->name == "log"
+                            || f->name == "sqrt") {
+                        out.push_back(f->name + "(");
+                        int i = 0;
+                        for (auto arg: f->args) {
+                            if (i > 0)
+                                out.push_back(std::string(", "));
+                            out.push_back(arg);
+                            i++;
+                        }
+                        out.push_back(std::string(")"));
+                    }
+                    else {
+                        error(std::string("function ") + f->name + " not yet handled\n");
+                    }
+                    break;
                 }
-            }
-            else {
-                expr.display("Term skipped");
-                error("Term skipped");
+                default:
+                    expr.display("Term skipped");
+                    error("Term skipped");
             }
         }
 
-        bool is_param(const std::string& name) {
-            for (auto p: params) {
-                if (p.first == name) return true;
+        /// \brief Returns `val' with as many digits as needed to read it back
+        /// exactly (folded constants are not always short decimals)
+        static std::string value_text(double val) {
+            std::ostringstream s;
+            s.precision(15);
+            s << val;
+            if (std::stod(s.str()) != val) {
+                s.str("");
+                s.precision(17);
+                s << val;
             }
-            return false;
+            if (val < 0) return "(" + s.str() + ")";
+            return s.str();
         }
 
-        bool is_var(const std::string& name) {
-            for (auto var: vars) {
-                if (var->name == name)
-                    return true;
-            }
-            return false;
+        /// \brief a-(b+c) and a/(b*c) need parentheses even if both
+        /// operators have the same precedence
+        static bool rhs_needs_parens(const bin_expr& be, const bin_expr& rhs) {
+            if (rhs.precedence < be.precedence) return true;
+            return rhs.precedence == be.precedence
+                && (be.op == '-' || be.op == '/');
         }
 
-        void get_vars(const expr& expr,
-                std::vector<const identifier *>& vars) {
+        bool is_param(symbol sym) const {
+            return sym < param_syms.size() && param_syms[sym];
+        }
 
-            const class expr *e = &expr;
-            if (auto id = dynamic_cast<const identifier *>(e)) {
-                if (is_var(id->name)) {
-                    bool add = true;
-                    for (auto var: vars) {
-                        if (id->name == var->name)
-                            add = false;
-                    }
-                    if (add)
-                        vars.push_back(id);
-                }
-            }
+        bool is_var(symbol sym) const {
+            return sym < var_index.size() && var_index[sym] >= 0;
+        }
+
+        /// \brief Tells if `sym' is solved for by the solver being emitted
+        bool is_unknown(symbol sym) const {
+            return is_var(sym)
+                && (unknowns.empty() || unknowns[var_index[sym]]);
+        }
 
-            for (auto c: expr.children) {
-                if (auto ex = dynamic_cast<const class expr *>(c.get())) {
-                    get_vars(*ex, vars);
+        /// \brief Returns the variables used in the expressions recorded in
+        /// tape `t', in order of appearance
+        std::vector<symbol> get_vars(const tape& t) {
+            std::vector<symbol> vars;
+            std::vector<bool> seen(var_index.size(), false);
+            for (tape::index i=0; i<t.size(); i++) {
+                switch (t.kind(i)) {
+                    case IDENTIFIER:
+                    case DELTA:
+                    case FIELD_VALUE: {
+                        symbol sym = t.sym(i);
+                        if (is_var(sym) && !seen[sym]) {
+                            seen[sym] = true;
+                            vars.push_back(sym);
+                        }
+                        break;
+                    }
+                    default:
+                        break;
                 }
             }
+            return vars;
         }
 
         void emit_bc(std::ostream& os,
                 const std::string& eq_name,
                 int location,
                 const expr& bc) {
+            for (auto& t: sum_terms(bc, false))
+                emit_bc_term(os, eq_name, location, *t.first);
+        }
+
+        void emit_bc_term(std::ostream& os,
+                const std::string& eq_name,
+                int location,
+                const expr& bc) {
 
-            if (auto de = dynamic_cast<const diff_expr *>(&bc)) {
-                if (auto id = dynamic_cast<const identifier *>(&de->expr)) {
-                    if (de->id.name == "r") {
+            switch (bc.kind) {
+                case DIFF_EXPR: {
+                    auto de = static_cast<const diff_expr *>(&bc);
+                    if (auto id = as<identifier>(de->expr)) {
+                        if (!is_unknown(id->sym)) break;
+                        if (de->id.name == "r") {
+                            switch (location) {
+                                case CENTER:
+                                    os << "    op->bc_bot2_add_l(0, \""
+                                        << eq_name << "\", \"" << id->name << "\", "
+                                        << "ones(1, 1), map.D.block(0).row(0));\n";
+                                    break;
+                                case SURFACE:
+                                    os << "    op->bc_top1_add_l(0, \""
+                                        << eq_name << "\", \"" << id->name << "\", "
+                                        << "ones(1, 1), map.D.block(-1).row(-1));\n";
+                                    break;
+                                case TOP:
+                                case BOTTOM:
+                                    TODO;
+                                    break;
+                                default:
+                                    error("Unknown BC location "
+                                            + std::to_string(location));
+                            }
+                        }
+                        else {
+                            error("Cannot differentiate wrt " + de->id.name
+                                    + " in boundary conditions");
+                        }
+                    }
+                    else {
+                        TODO;
+                    }
+                    break;
+                }
+                case IDENTIFIER:
+                case DELTA:
+                case FIELD_VALUE: {
+                    auto id = static_cast<const identifier *>(&bc);
+                    if (is_var(id->sym) && !is_unknown(id->sym)) break;
+                    if (is_var(id->sym)) {
                         switch (location) {
                             case CENTER:
-                                os << "    op->bc_bot2_add_l(0, \""
+                                os << "    op->bc_bot2_add_d(0, \""
                                     << eq_name << "\", \"" << id->name << "\", "
-                                    << "ones(1, 1), map.D.block(0).row(0));\n";
+                                    << "ones(1, 1));\n";
                                 break;
                             case SURFACE:
-                                os << "    op->bc_top1_add_l(0, \""
+                                os << "    op->bc_top1_add_d(0, \""
                                     << eq_name << "\", \"" << id->name << "\", "
-                                    << "ones(1, 1), map.D.block(-1).row(-1));\n";
+                                    << "ones(1, 1));\n";
                                 break;
                             case TOP:
                             case BOTTOM:
@@ -622,60 +1590,55 @@ class solver {
                         }
                     }
                     else {
-                        error("Cannot differentiate wrt " + de->id.name
-                                + " in boundary conditions");
+                        error("Only variables are allowed in BC");
                     }
+                    break;
                 }
-                else {
+                case VALUE:
+                    // constants only contribute to the RHS
+                    break;
+                default:
                     TODO;
-                }
-            }
-            else if (auto be = dynamic_cast<const bin_expr *>(&bc)) {
-                switch (be->op) {
-                    case '+':
-                        emit_bc(os, eq_name, location, be->lhs);
-                        emit_bc(os, eq_name, location, be->rhs);
-                        break;
-                    default:
-                        TODO;
-                }
-            }
-            else if (auto id = dynamic_cast<const identifier *>(&bc)) {
-                if (is_var(id->name)) {
-                    switch (location) {
-                        case CENTER:
-                            os << "    op->bc_bot2_add_d(0, \""
-                                << eq_name << "\", \"" << id->name << "\", "
-                                << "ones(1, 1));\n";
-                            break;
-                        case SURFACE:
-                            os << "    op->bc_top1_add_d(0, \""
-                                << eq_name << "\", \"" << id->name << "\", "
-                                << "ones(1, 1));\n";
-                            break;
-                        case TOP:
-                        case BOTTOM:
-                            TODO;
-                            break;
-                        default:
-                            error("Unknown BC location "
-                                    + std::to_string(location));
-                    }
-                }
-                else {
-                    error("Only variables are allowed in BC");
-                }
-            }
-            else {
-                TODO;
             }
         }
 
     private:
         std::vector<std::shared_ptr<const ir::variable>> vars; 
-        std::vector<std::shared_ptr<const ir::equation>> eqs; 
+        std::vector<const ir::equation *> eqs; 
 
         std::map<std::string, std::string> params; 
+
+        differentiator der;
+
+        bool newton_driver = false;
+        bool reuse_jacobian = false;
+        bool parallel = false;
+        // whether update code assembles the operator or only the RHS
+        bool assemble = true;
+        // kernels used by the block being emitted, by name
+        std::map<std::string, std::string> kernels;
+
+        // common subexpressions, indexed by `symbolic'
+        bool collecting = false;
+        std::vector<expr_ptr> cse_roots[2];
+        std::unordered_map<expr_ptr, std::string> temps[2];
+        std::vector<expr_ptr> temp_defs[2];
+        // temporaries written by the member being emitted
+        std::unordered_set<expr_ptr> used_temps[2];
+
+        // variables solved for by the solver being emitted, by position, and
+        // the list of these variables (in the order of `vars')
+        std::vector<bool> unknowns;
+        std::vector<std::shared_ptr<const ir::variable>> block_vars;
+
+        // position of variables in `vars' and parameters, indexed by symbol
+        std::vector<int> var_index;
+        std::vector<bool> param_syms;
+
+        static void mark(std::vector<bool>& set, symbol sym) {
+            if (sym >= set.size()) set.resize(sym + 1, false);
+            set[sym] = true;
+        }
 };
 
 }
@@ -0,0 +1,58 @@
+#ifndef SYMBOLS_H
+#define SYMBOLS_H
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+
+namespace ir {
+
+/// \brief Interned name: a small integer indexing a symbol_table
+typedef uint32_t symbol;
+
+///
+/// \brief Interns names into dense integer IDs
+///
+/// Symbols are numbered from 0 in order of first appearance, so they can
+/// index plain arrays. References returned by name() stay valid as long as
+/// the table.
+///
+class symbol_table {
+    public:
+        symbol_table() { }
+        symbol_table(const symbol_table& t) = delete;
+
+        /// \brief Returns the symbol of `name', creating it if needed
+        symbol intern(const std::string& name) {
+            auto it = index.find(name);
+            if (it != index.end()) return it->second;
+            symbol s = names.size();
+            names.push_back(name);
+            index[name] = s;
+            return s;
+        }
+
+        /// \brief Looks up `name' without creating it
+        ///
+        /// Returns false if `name' has never been interned.
+        bool find(const std::string& name, symbol& s) const {
+            auto it = index.find(name);
+            if (it == index.end()) return false;
+            s = it->second;
+            return true;
+        }
+
+        const std::string& name(symbol s) const { return names[s]; }
+
+        /// \brief Number of symbols in the table
+        size_t size() const { return names.size(); }
+
+    private:
+        std::deque<std::string> names;
+        std::unordered_map<std::string, symbol> index;
+};
+
+} // end namespace ir
+
+#endif
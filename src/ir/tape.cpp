@@ -0,0 +1,142 @@
+#include "tape.hpp"
+
+#include <utility>
+
+namespace ir {
+
+static inline const expr& operand_of(const expr& e, size_t i) {
+    // children of an expression are expressions
+    return *static_cast<const expr *>(e.child(i));
+}
+
+tape::index tape::record(const expr& e) {
+    auto it = recorded.find(&e);
+    if (it != recorded.end()) return it->second;
+
+    // iterative post-order traversal: a node is pushed once all its operands
+    // are in the tape
+    std::vector<std::pair<const expr *, size_t>> stack;
+    stack.push_back(std::make_pair(&e, 0));
+    while (!stack.empty()) {
+        const expr *node = stack.back().first;
+        size_t& next = stack.back().second;
+        if (next < node->n_children()) {
+            const expr *child = &operand_of(*node, next++);
+            if (recorded.find(child) == recorded.end())
+                stack.push_back(std::make_pair(child, 0));
+        }
+        else {
+            // a node is never its own operand: it is on the stack once
+            index i = push(*node);
+            recorded.emplace(node, i);
+            stack.pop_back();
+        }
+    }
+    return kinds.size() - 1;
+}
+
+tape::index tape::push(const expr& e) {
+    index payload = 0;
+    char op = 0;
+    switch (e.kind) {
+        case VALUE:
+            payload = constants.size();
+            constants.push_back(static_cast<const value&>(e).val);
+            break;
+        case IDENTIFIER:
+        case DELTA:
+        case FIELD_VALUE:
+            payload = static_cast<const identifier&>(e).sym;
+            break;
+        case FUNC:
+            payload = intern_name(static_cast<const func&>(e).name);
+            break;
+        case BIN_EXPR:
+            op = static_cast<const bin_expr&>(e).op;
+            break;
+        case UNARY_EXPR:
+            op = static_cast<const unary_expr&>(e).op;
+            break;
+        default:
+            break;
+    }
+
+    kinds.push_back(e.kind);
+    ops.push_back(op);
+    firsts.push_back(operands.size());
+    counts.push_back(e.n_children());
+    payloads.push_back(payload);
+    exprs.push_back(&e);
+    for (size_t i=0; i<e.n_children(); i++) {
+        operands.push_back(recorded.at(&operand_of(e, i)));
+    }
+    return kinds.size() - 1;
+}
+
+tape::index tape::intern_name(const std::string& name) {
+    auto it = name_index.find(name);
+    if (it != name_index.end()) return it->second;
+    index i = names.size();
+    names.push_back(name);
+    name_index[name] = i;
+    return i;
+}
+
+expr_ptr tape::rebuild(index root) const {
+    if (root >= size()) {
+        error("Invalid tape index " + std::to_string(root));
+    }
+
+    // only rebuild the entries the root depends on
+    std::vector<bool> needed(root + 1, false);
+    needed[root] = true;
+    for (index i=root+1; i-- > 0; ) {
+        if (!needed[i]) continue;
+        for (size_t j=0; j<n_operands(i); j++)
+            needed[operand(i, j)] = true;
+    }
+
+    std::vector<expr_ptr> exprs(root + 1, NULL);
+    for (index i=0; i<=root; i++) {
+        if (needed[i]) exprs[i] = make_node(i, exprs);
+    }
+    return exprs[root];
+}
+
+expr_ptr tape::make_node(index i, const std::vector<expr_ptr>& exprs) const {
+    switch (kind(i)) {
+        case VALUE:
+            return make<value>(val(i));
+        case IDENTIFIER:
+            return make<identifier>(sym(i));
+        case DELTA:
+            return make<delta>(sym(i));
+        case FIELD_VALUE:
+            return make<field_value>(sym(i), exprs[operand(i, 0)]);
+        case BIN_EXPR:
+            return make<bin_expr>(exprs[operand(i, 0)], op(i),
+                    exprs[operand(i, 1)]);
+        case UNARY_EXPR:
+            return make<unary_expr>(op(i), exprs[operand(i, 0)]);
+        case FUNC: {
+            std::vector<expr_ptr> args;
+            for (size_t j=0; j<n_operands(i); j++)
+                args.push_back(exprs[operand(i, j)]);
+            return make<func>(name(i), args);
+        }
+        case DIV_EXPR:
+            return make<div_expr>(exprs[operand(i, 0)]);
+        case GRAD_EXPR:
+            return make<grad_expr>(exprs[operand(i, 0)]);
+        case LAP_EXPR:
+            return make<lap_expr>(exprs[operand(i, 0)]);
+        case DIFF_EXPR:
+            return make<diff_expr>(exprs[operand(i, 0)],
+                    static_cast<const identifier *>(exprs[operand(i, 1)]));
+        default:
+            error("Unknown expression kind " + std::to_string(kind(i)));
+            return NULL;
+    }
+}
+
+} // end namespace ir
@@ -0,0 +1,96 @@
+#ifndef TAPE_H
+#define TAPE_H
+
+#include "ir.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+namespace ir {
+
+///
+/// \brief Linear (post-order) representation of expressions
+///
+/// Each entry of the tape is a node of an expression, stored as a structure
+/// of arrays: its kind, its operator, the indices of its operands and a
+/// payload: an index in the constant pool (values), in the name pool
+/// (functions) or the symbol of an identifier. Operands are always recorded
+/// before the node using them, so a pass can evaluate or analyse an
+/// expression with a single loop over the tape, without recursion.
+///
+/// Sub-expressions shared in the DAG are recorded once: recording several
+/// expressions (e.g., both sides of an equation) in the same tape shares
+/// their common nodes.
+///
+class tape {
+    public:
+        typedef uint32_t index;
+
+        tape() { }
+        tape(const tape& t) = delete;
+
+        /// \brief Records expression `e' (and its operands not yet in the
+        /// tape) and returns the index of its root
+        index record(const expr& e);
+
+        /// \brief Rebuilds the expression rooted at entry `i' in the current
+        /// context
+        expr_ptr rebuild(index i) const;
+
+        /// \brief Builds the node of entry `i' in the current context, with
+        /// operand `j' replaced by `exprs[operand(i, j)]'
+        expr_ptr make_node(index i, const std::vector<expr_ptr>& exprs) const;
+
+        /// \brief Number of entries of the tape
+        size_t size() const { return kinds.size(); }
+
+        expr_kind kind(index i) const {
+            return static_cast<expr_kind>(kinds[i]);
+        }
+
+        /// \brief Operator of a binary or unary expression
+        char op(index i) const { return ops[i]; }
+
+        size_t n_operands(index i) const { return counts[i]; }
+
+        /// \brief Index of the j-th operand of entry `i'
+        index operand(index i, size_t j) const {
+            return operands[firsts[i] + j];
+        }
+
+        /// \brief Expression recorded at entry `i'
+        expr_ptr node(index i) const { return exprs[i]; }
+
+        /// \brief Value of a VALUE entry
+        double val(index i) const { return constants[payloads[i]]; }
+
+        /// \brief Symbol of an identifier
+        symbol sym(index i) const { return payloads[i]; }
+
+        /// \brief Name of a function
+        const std::string& name(index i) const { return names[payloads[i]]; }
+
+    private:
+        std::vector<uint8_t> kinds;
+        std::vector<char> ops;
+        std::vector<index> firsts;
+        std::vector<index> counts;
+        std::vector<index> payloads;
+        std::vector<expr_ptr> exprs;
+
+        std::vector<index> operands;
+        std::vector<double> constants;
+        std::vector<std::string> names;
+
+        std::unordered_map<expr_ptr, index> recorded;
+        std::unordered_map<std::string, index> name_index;
+
+        index push(const expr& e);
+        index intern_name(const std::string& name);
+};
+
+} // end namespace ir
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef VISITOR_H
+#define VISITOR_H
+
+#include "ir.hpp"
+#include "tape.hpp"
+
+#include <unordered_map>
+
+namespace ir {
+
+///
+/// \brief Dispatches on the kind of an expression with a single switch
+///
+/// Deltas and field values are visited as identifiers unless visit_delta or
+/// visit_field_value are overridden. Kinds that are not handled by a visitor
+/// end up in visit_expr, which reports the expression as skipped.
+///
+template <class R>
+class visitor {
+    public:
+        virtual ~visitor() { }
+
+        R visit(const expr& e) {
+            switch (e.kind) {
+                case VALUE:
+                    return visit_value(static_cast<const value&>(e));
+                case IDENTIFIER:
+                    return visit_identifier(static_cast<const identifier&>(e));
+                case DELTA:
+                    return visit_delta(static_cast<const delta&>(e));
+                case FIELD_VALUE:
+                    return visit_field_value(
+                            static_cast<const field_value&>(e));
+                case BIN_EXPR:
+                    return visit_bin_expr(static_cast<const bin_expr&>(e));
+                case UNARY_EXPR:
+                    return visit_unary_expr(static_cast<const unary_expr&>(e));
+                case FUNC:
+                    return visit_func(static_cast<const func&>(e));
+                case DIV_EXPR:
+                    return visit_div_expr(static_cast<const div_expr&>(e));
+                case GRAD_EXPR:
+                    return visit_grad_expr(static_cast<const grad_expr&>(e));
+                case LAP_EXPR:
+                    return visit_lap_expr(static_cast<const lap_expr&>(e));
+                case DIFF_EXPR:
+                    return visit_diff_expr(static_cast<const diff_expr&>(e));
+            }
+            error("Unknown expression kind " + std::to_string(e.kind));
+        }
+
+    protected:
+        virtual R visit_expr(const expr& e) {
+            e.display("Term skipped");
+            error("Term skipped");
+        }
+
+        virtual R visit_value(const value& v) { return visit_expr(v); }
+        virtual R visit_identifier(const identifier& id) {
+            return visit_expr(id);
+        }
+        virtual R visit_delta(const delta& d) { return visit_identifier(d); }
+        virtual R visit_field_value(const field_value& fv) {
+            return visit_identifier(fv);
+        }
+        virtual R visit_bin_expr(const bin_expr& be) { return visit_expr(be); }
+        virtual R visit_unary_expr(const unary_expr& ue) {
+            return visit_expr(ue);
+        }
+        virtual R visit_func(const func& f) { return visit_expr(f); }
+        virtual R visit_div_expr(const div_expr& de) { return visit_expr(de); }
+        virtual R visit_grad_expr(const grad_expr& ge) {
+            return visit_expr(ge);
+        }
+        virtual R visit_lap_expr(const lap_expr& le) { return visit_expr(le); }
+        virtual R visit_diff_expr(const diff_expr& de) {
+            return visit_expr(de);
+        }
+};
+
+///
+/// \brief Visitor building a new expression from an expression
+///
+/// By default each node is rebuilt from its rewritten children (and returned
+/// as is if none of them changed), so a rewriter only overrides the kinds it
+/// transforms. Results are memoized per node: a sub-expression shared by
+/// several parents is rewritten once.
+///
+/// Every node of the expression is visited, operands first, in the order of
+/// a tape: when a visit rewrites the operands of a node, they are already in
+/// the cache. The depth of the recursion does not grow with the depth of the
+/// expression (long sums are deep trees).
+///
+class rewriter : public visitor<expr_ptr> {
+    public:
+        expr_ptr rewrite(const expr& e) {
+            auto it = cache.find(&e);
+            if (it != cache.end()) return it->second;
+            tape t;
+            t.record(e);
+            for (tape::index i=0; i<t.size(); i++) {
+                expr_ptr node = t.node(i);
+                if (!cache.count(node)) cache[node] = visit(*node);
+            }
+            return cache[&e];
+        }
+
+    protected:
+        virtual expr_ptr visit_value(const value& v) { return &v; }
+
+        virtual expr_ptr visit_identifier(const identifier& id) {
+            return &id;
+        }
+
+        virtual expr_ptr visit_field_value(const field_value& fv) {
+            expr_ptr index = rewrite(fv.index);
+            if (index == &fv.index) return &fv;
+            return make<field_value>(fv.sym, index);
+        }
+
+        virtual expr_ptr visit_bin_expr(const bin_expr& be) {
+            expr_ptr lhs = rewrite(be.lhs);
+            expr_ptr rhs = rewrite(be.rhs);
+            if (lhs == &be.lhs && rhs == &be.rhs) return &be;
+            return make<bin_expr>(lhs, be.op, rhs);
+        }
+
+        virtual expr_ptr visit_unary_expr(const unary_expr& ue) {
+            expr_ptr e = rewrite(ue.expr);
+            if (e == &ue.expr) return &ue;
+            return make<unary_expr>(ue.op, e);
+        }
+
+        virtual expr_ptr visit_func(const func& f) {
+            std::vector<expr_ptr> args;
+            bool same = true;
+            for (auto arg: f.args) {
+                args.push_back(rewrite(*arg));
+                same = same && args.back() == arg;
+            }
+            if (same) return &f;
+            return make<func>(f.name, args);
+        }
+
+        virtual expr_ptr visit_div_expr(const div_expr& de) {
+            expr_ptr e = rewrite(de.expr);
+            if (e == &de.expr) return &de;
+            return make<div_expr>(e);
+        }
+
+        virtual expr_ptr visit_grad_expr(const grad_expr& ge) {
+            expr_ptr e = rewrite(ge.expr);
+            if (e == &ge.expr) return &ge;
+            return make<grad_expr>(e);
+        }
+
+        virtual expr_ptr visit_lap_expr(const lap_expr& le) {
+            expr_ptr e = rewrite(le.expr);
+            if (e == &le.expr) return &le;
+            return make<lap_expr>(e);
+        }
+
+        virtual expr_ptr visit_diff_expr(const diff_expr& de) {
+            expr_ptr e = rewrite(de.expr);
+            if (e == &de.expr) return &de;
+            return make<diff_expr>(e, &de.id);
+        }
+
+    private:
+        std::unordered_map<const expr *, expr_ptr> cache;
+};
+
+} // end namespace ir
+
+#endif
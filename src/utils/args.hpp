@@ -48,18 +48,26 @@ class args {
 
         void add_pos_arg(const std::string& name);
 
+        /// \brief Accepts positional arguments beyond the named ones instead
+        /// of ignoring them, see get_extra_pos_args()
+        void allow_extra_pos_args() { extra_pos_args = true; }
+
         int parse(int argc, char *argv[]);
 
         void print();
 
         std::string get(const std::string& key);
 
+        /// \brief Positional arguments given after the named ones
+        std::vector<std::string> get_extra_pos_args();
+
     private:
         std::vector<arg> opts;
         std::map<std::string, std::string> values;
 
         std::vector<std::string> pos_args_names;
         std::vector<std::string> pos_args_values;
+        bool extra_pos_args = false;
 };
 
 } // end namespace cmdline
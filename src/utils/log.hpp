@@ -5,32 +5,29 @@
 
 #include <iostream>
 #include <cstdlib>
+#include <stdexcept>
 #include <string>
 #include <ctime>
 
 ///
-/// \brief Used to report an error: print an error message and exit the program,
-/// returning EXIT_FAILURE
+/// \brief Used to report an error: throws a log::fatal_error holding the
+/// location and the message, which the program reports before returning
+/// EXIT_FAILURE (in batch mode, only the model being compiled fails)
 ///
-#define error(msg) { std::cerr              \
-    << termcolor::bold << termcolor::red    \
-    << "[ERROR]: "                          \
-    << termcolor::reset                     \
-    << termcolor::bold                      \
-    << __FILE__ << ":" << __LINE__ << ", "  \
-    << termcolor::reset                     \
-    << "in function "                       \
-    << termcolor::bold                      \
-    << __func__ << ": "                     \
-    << termcolor::reset                     \
-    << termcolor::bold << termcolor::red    \
-    << (msg) << '\n'                        \
-    << termcolor::reset;                    \
-    std::exit(EXIT_FAILURE);                \
+#define error(msg) {                                            \
+    throw log::fatal_error(std::string(__FILE__) + ":"          \
+            + std::to_string(__LINE__) + ", in function "       \
+            + __func__ + ": " + (msg));                         \
 }
 
 namespace log {
 
+    /// \brief Error thrown by error()
+    class fatal_error : public std::runtime_error {
+        public:
+            fatal_error(const std::string& what) : std::runtime_error(what) { }
+    };
+
     /*
     std::string str_time() {
         time_t rawtime;
@@ -1,16 +1,65 @@
 #include "log.hpp"
+#include "args.hpp"
+
+#include <vector>
 
 void foo() {
     error("This is a test error");
 }
 
+// parses the command line `argv' with the options of ester-lang
+static cmdline::args parse_args(std::vector<const char *> argv) {
+    cmdline::args args;
+    args.add_pos_arg("filename");
+    args.allow_extra_pos_args();
+    args.add_opt("o", cmdline::required_argument);
+    args.add_opt("newton", "0", cmdline::no_argument);
+    args.add_opt("batch", "0", cmdline::no_argument);
+    argv.insert(argv.begin(), "test-utils");
+    if (args.parse(argv.size(), const_cast<char **>(argv.data())))
+        error("command line parsing failed");
+    return args;
+}
+
+void test_args() {
+    // flags followed by a positional argument are set
+    cmdline::args a1 = parse_args({"-batch", "a", "b"});
+    if (a1.get("batch") == "0" || a1.get("filename") != "a"
+            || a1.get_extra_pos_args() != std::vector<std::string>({"b"}))
+        error("-batch a b parsed wrong");
+
+    cmdline::args a2 = parse_args({"-newton", "m.eq", "-o", "x"});
+    if (a2.get("newton") == "0" || a2.get("filename") != "m.eq"
+            || a2.get("o") != "x" || a2.get_extra_pos_args().size())
+        error("-newton m.eq -o x parsed wrong");
+
+    cmdline::args a3 = parse_args({"m.eq", "-o", "x"});
+    if (a3.get("newton") != "0" || a3.get("batch") != "0")
+        error("unset flags parsed as set");
+}
+
 int main() {
 
+    try {
+        test_args();
+    }
+    catch (log::fatal_error& e) {
+        log::err() << e.what() << '\n';
+        return EXIT_FAILURE;
+    }
+
     log::err() << "This is an error\n";
     log::warn() << "This is a warning\n";
     log::log() << "This is an info\n";
 
-    foo();
+    // error() is expected to throw
+    try {
+        foo();
+    }
+    catch (log::fatal_error& e) {
+        log::err() << e.what() << '\n';
+        return EXIT_SUCCESS;
+    }
 
-    return 0;
+    return EXIT_FAILURE;
 }
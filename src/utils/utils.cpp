@@ -39,9 +39,10 @@ namespace cmdline {
         if (n < argc) {
             opt = argv[n++];
 
-            if (opt[0] == '-') {
+            // a lone `-' (standard input) is an argument, not an option
+            if (opt[0] == '-' && opt != "-") {
                 if (n < argc) {
-                    if (argv[n][0] == '-') arg = "";
+                    if (argv[n][0] == '-' && argv[n] != "-") arg = "";
                     else arg = argv[n++];
                 }
                 else arg = "";
@@ -78,7 +79,7 @@ namespace cmdline {
         }
 
         while (parser.getopt(opt, arg)) {
-            if (opt[0] == '-') {
+            if (opt[0] == '-' && opt != "-") {
                 bool found_opt = false;
                 for (auto o: opts) {
                     if (std::string("-") + o.name == opt) {
@@ -96,6 +97,8 @@ namespace cmdline {
                         }
                         else {
                             if (o.has_arg == no_argument) {
+                                // a flag followed by a positional argument
+                                values[o.name] = "";
                                 pos_args_values.push_back(std::string(arg));
                             }
                             else {
@@ -121,7 +124,8 @@ namespace cmdline {
                 << pos_args_names[pos_args_values.size()] << '\n';
             return 1;
         }
-        if (pos_args_values.size() > pos_args_names.size()) {
+        if (pos_args_values.size() > pos_args_names.size() &&
+                !extra_pos_args) {
             std::string ignored_arg = "";
             for (size_t i=pos_args_names.size(); i<pos_args_values.size(); i++) {
                 ignored_arg = ignored_arg + " " + pos_args_values[i];
@@ -160,5 +164,13 @@ namespace cmdline {
         return values[key];
     }
 
+    std::vector<std::string> args::get_extra_pos_args() {
+        if (pos_args_values.size() <= pos_args_names.size())
+            return std::vector<std::string>();
+        return std::vector<std::string>(
+                pos_args_values.begin() + pos_args_names.size(),
+                pos_args_values.end());
+    }
+
 } // end namespace cmdline
 
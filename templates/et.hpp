@@ -0,0 +1,174 @@
+#ifndef ESTER_ET_H
+#define ESTER_ET_H
+
+#include <cmath>
+#include <vector>
+
+// Expression templates: an expression on fields builds, at compile time, a
+// tree of small objects whose type encodes the operations. Assigning it to
+// an array evaluates the whole tree point by point in a single loop, which
+// the compiler can inline and vectorize without any temporary array.
+//
+// The generated code writes simd.hpp first: assignment loops are ESTER_SIMD
+// loops, vectorized like the kernels of the libester backend, and the
+// functions containing them are ESTER_KERNEL.
+namespace et {
+
+template <class E>
+struct expr {
+    const E& self() const { return static_cast<const E&>(*this); }
+};
+
+// field given by its values at the grid points
+struct field : expr<field> {
+    explicit field(const double *p) : p(p) { }
+    double operator[](int i) const { return p[i]; }
+    const double *p;
+};
+
+// scalar, same value at all points
+struct scalar : expr<scalar> {
+    explicit scalar(double v) : v(v) { }
+    double operator[](int) const { return v; }
+    const double v;
+};
+
+// operands are stored by value: nodes are small and expressions are built
+// from temporaries
+template <class L, class R, class Op>
+struct binary : expr<binary<L, R, Op>> {
+    binary(const L& l, const R& r) : l(l), r(r) { }
+    double operator[](int i) const { return Op::apply(l[i], r[i]); }
+    const L l;
+    const R r;
+};
+
+template <class A, class Op>
+struct unary : expr<unary<A, Op>> {
+    explicit unary(const A& a) : a(a) { }
+    double operator[](int i) const { return Op::apply(a[i]); }
+    const A a;
+};
+
+struct add_op { static double apply(double a, double b) { return a + b; } };
+struct sub_op { static double apply(double a, double b) { return a - b; } };
+struct mul_op { static double apply(double a, double b) { return a * b; } };
+struct div_op { static double apply(double a, double b) { return a / b; } };
+struct pow_op {
+    static double apply(double a, double b) { return std::pow(a, b); }
+};
+
+struct neg_op { static double apply(double a) { return -a; } };
+struct sin_op { static double apply(double a) { return std::sin(a); } };
+struct cos_op { static double apply(double a) { return std::cos(a); } };
+struct exp_op { static double apply(double a) { return std::exp(a); } };
+struct log_op { static double apply(double a) { return std::log(a); } };
+struct sqrt_op { static double apply(double a) { return std::sqrt(a); } };
+
+#define ET_BINARY(F, OP) \
+    template <class L, class R> \
+    inline binary<L, R, OP> F(const expr<L>& l, const expr<R>& r) { \
+        return binary<L, R, OP>(l.self(), r.self()); \
+    } \
+    template <class L> \
+    inline binary<L, scalar, OP> F(const expr<L>& l, double r) { \
+        return binary<L, scalar, OP>(l.self(), scalar(r)); \
+    } \
+    template <class R> \
+    inline binary<scalar, R, OP> F(double l, const expr<R>& r) { \
+        return binary<scalar, R, OP>(scalar(l), r.self()); \
+    }
+
+ET_BINARY(operator+, add_op)
+ET_BINARY(operator-, sub_op)
+ET_BINARY(operator*, mul_op)
+ET_BINARY(operator/, div_op)
+ET_BINARY(pow, pow_op)
+
+#undef ET_BINARY
+
+#define ET_UNARY(F, OP) \
+    template <class A> \
+    inline unary<A, OP> F(const expr<A>& a) { \
+        return unary<A, OP>(a.self()); \
+    }
+
+ET_UNARY(operator-, neg_op)
+ET_UNARY(sin, sin_op)
+ET_UNARY(cos, cos_op)
+ET_UNARY(exp, exp_op)
+ET_UNARY(log, log_op)
+ET_UNARY(sqrt, sqrt_op)
+
+#undef ET_UNARY
+
+// functions of scalars only are the ones of the standard library
+using std::pow;
+using std::sin;
+using std::cos;
+using std::exp;
+using std::log;
+using std::sqrt;
+
+// out[i] = e[i] for the npts points
+template <class E>
+inline void assign(double *out, int npts, const expr<E>& e) {
+    const E& x = e.self();
+    ESTER_SIMD
+    for (int i=0; i<npts; i++)
+        out[i] = x[i];
+}
+
+inline void assign(double *out, int npts, double v) {
+    ESTER_SIMD
+    for (int i=0; i<npts; i++)
+        out[i] = v;
+}
+
+// value of an expression at point i
+template <class E>
+inline double at(const expr<E>& e, int i) { return e.self()[i]; }
+
+inline double at(double v, int) { return v; }
+
+// out = D x, with D a dense n x n matrix stored by rows
+inline void diff(int n, const double *D, const double *x, double *out) {
+    for (int i=0; i<n; i++) {
+        double s = 0.;
+        for (int j=0; j<n; j++)
+            s += D[i*n+j] * x[j];
+        out[i] = s;
+    }
+}
+
+// (D x)[i]: the derivative at point i only, in O(n)
+inline double diff_at(int n, const double *D, const double *x, int i) {
+    double s = 0.;
+    for (int j=0; j<n; j++)
+        s += D[i*n+j] * x[j];
+    return s;
+}
+
+// spherically symmetric laplacian d2x/dr2 + 2/r dx/dr, which tends to
+// 3 d2x/dr2 at the center
+inline void lap(int n, const double *D, const double *r, const double *x,
+        double *out) {
+    std::vector<double> dx(n), d2x(n);
+    diff(n, D, x, &dx[0]);
+    diff(n, D, &dx[0], &d2x[0]);
+    for (int i=0; i<n; i++)
+        out[i] = r[i] == 0. ? 3*d2x[i] : d2x[i] + 2*dx[i]/r[i];
+}
+
+// laplacian at point i only: dx is needed at all the points, d2x only at i
+inline double lap_at(int n, const double *D, const double *r,
+        const double *x, int i) {
+    std::vector<double> dx(n);
+    diff(n, D, x, &dx[0]);
+    double d2x = diff_at(n, D, &dx[0], i);
+    return r[i] == 0. ? 3*d2x : d2x + 2*dx[i]/r[i];
+}
+
+} // end namespace et
+
+#endif
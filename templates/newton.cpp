@@ -0,0 +1,101 @@
+#include <memory>
+#include <vector>
+
+// Newton driver: at each iteration the blocks are solved in order, the
+// correction of a block is damped by a backtracking line search until the
+// max norm of its residual satisfies the Armijo condition
+// |F(x + lambda dx)| <= (1 - alpha lambda) |F(x)|. The first step tried is
+// twice the step accepted at the previous iteration (capped to a full step),
+// so that damping is relaxed as soon as the iterations get close to the
+// solution. Trial steps only evaluate the RHS. When the condition still
+// fails after max_backtracks reductions, the last step is kept and the failed
+// line search is counted in newton_stats.
+//
+// With newton_reuse_jacobian, the operator of a block (and its
+// factorization) is kept across iterations as long as the correction
+// decreases by at least a factor theta_max per iteration, and is assembled
+// again once the contraction degrades (modified Newton).
+newton_stats newton_solve(double tol, int max_it, int verbose) {
+    const double alpha = 1e-4;
+    const double theta_max = .5;
+    const int max_backtracks = 10;
+
+    newton_stats stats;
+    stats.iterations = 0;
+    stats.backtracks = 0;
+    stats.failed_searches = 0;
+    stats.assemblies = 0;
+    stats.error = 0.;
+    stats.residual = 0.;
+    stats.converged = false;
+
+    std::vector<std::unique_ptr<solver_context>> blocks;
+    for (int k=0; k<n_solver_blocks; k++)
+        blocks.emplace_back(create_solver_context(k));
+    std::vector<double> lambdas(n_solver_blocks, 1.);
+    std::vector<double> corrections(n_solver_blocks, -1.);
+
+    while (stats.iterations < max_it) {
+        stats.iterations++;
+        stats.error = 0.;
+        stats.residual = 0.;
+        for (int k=0; k<n_solver_blocks; k++) {
+            solver_context *s = blocks[k].get();
+            bool reused = newton_reuse_jacobian && corrections[k] >= 0.;
+            if (reused) {
+                s->update_rhs();
+            }
+            else {
+                s->update();
+                stats.assemblies++;
+            }
+            double r0 = s->residual();
+            s->solve();
+            double correction = s->correction();
+            if (reused && correction > theta_max*corrections[k]) {
+                // the operator is too far from the jacobian
+                s->update();
+                stats.assemblies++;
+                s->solve();
+                correction = s->correction();
+            }
+            corrections[k] = correction;
+            s->start_step();
+
+            double lambda = 2*lambdas[k] < 1. ? 2*lambdas[k] : 1.;
+            double r = r0;
+            for (int i=0; ; i++) {
+                s->step(lambda);
+                s->update_rhs();
+                r = s->residual();
+                if (r <= (1. - alpha*lambda)*r0)
+                    break;
+                if (i == max_backtracks) {
+                    stats.failed_searches++;
+                    break;
+                }
+                lambda /= 2.;
+                stats.backtracks++;
+            }
+            lambdas[k] = lambda;
+
+            if (correction > stats.error) stats.error = correction;
+            if (r > stats.residual) stats.residual = r;
+        }
+        if (verbose) {
+            printf("Newton iteration %3d: error %e, residual %e, step %f\n",
+                    stats.iterations, stats.error, stats.residual,
+                    lambdas[0]);
+        }
+        if (stats.error < tol) {
+            stats.converged = true;
+            break;
+        }
+    }
+
+    if (verbose && !stats.converged) {
+        printf("Newton did not converge after %d iterations\n",
+                stats.iterations);
+    }
+    return stats;
+}
@@ -0,0 +1,47 @@
+#ifndef ESTER_SIMD_H
+#define ESTER_SIMD_H
+
+#include <cmath>
+
+// Pointwise kernels are compiled for several instruction sets, the one used
+// is chosen for the CPU when the program is loaded (GCC function
+// multi-versioning, x86_64 only). Their loops are vectorized with
+// -fopenmp-simd (or -fopenmp). Loops calling sqrt also need -fno-math-errno,
+// the instruction computing it does not set errno.
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__)
+#define ESTER_KERNEL \
+    __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define ESTER_KERNEL
+#endif
+
+// Vector versions of pow, sin, cos, exp and log are provided by glibc's
+// libmvec (linked along with libm). math.h only declares them with
+// -ffast-math: without it, a loop calling these functions is not vectorized.
+// They differ from the scalar functions by at most a few ulps and do not set
+// errno.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 6 \
+    && defined(__x86_64__) && defined(__GLIBC__) && !defined(__FAST_MATH__)
+#if __GLIBC_PREREQ(2, 22)
+#define ESTER_VECTOR_MATH __attribute__((simd("notinbranch")))
+extern "C" {
+    ESTER_VECTOR_MATH double pow(double, double) noexcept;
+    ESTER_VECTOR_MATH double sin(double) noexcept;
+    ESTER_VECTOR_MATH double cos(double) noexcept;
+    ESTER_VECTOR_MATH double exp(double) noexcept;
+    ESTER_VECTOR_MATH double log(double) noexcept;
+}
+#endif
+#endif
+
+// With ESTER_PARALLEL (ester-lang -parallel) and -fopenmp, large grids are
+// also split between threads. Points are independent, so results do not
+// depend on the number of threads.
+#if defined(ESTER_PARALLEL) && defined(_OPENMP)
+#define ESTER_SIMD \
+    _Pragma("omp parallel for simd schedule(static) if(npts >= 4096)")
+#else
+#define ESTER_SIMD _Pragma("omp simd")
+#endif
+
+#endif
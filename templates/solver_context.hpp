@@ -0,0 +1,59 @@
+#ifndef SOLVER_CONTEXT_H
+#define SOLVER_CONTEXT_H
+
+// Solver of a block of equations, reused across Newton iterations: the
+// mapping, the registration of the variables and the operator are set up
+// once, update() refreshes the operator and the RHS from the current value
+// of the variables before each solve()
+class solver_context {
+    public:
+        solver_context() : op(new solver()) { }
+        virtual ~solver_context() { delete op; }
+
+        virtual void update() = 0;
+        // only refreshes the RHS, solve() then reuses the operator assembled
+        // (and factorized) by the last update()
+        virtual void update_rhs() = 0;
+        void solve() { op->solve(); }
+        matrix get_var(const char *var) { return op->get_var(var); }
+
+        // saves the value of the unknowns and the correction found by the
+        // last solve(), step(lambda) then sets unknowns to saved + lambda *
+        // correction
+        virtual void start_step() = 0;
+        virtual void step(double lambda) = 0;
+        // max norm of the correction of the last solve()
+        virtual double correction() = 0;
+        // max norm of the residual computed by the last update()
+        virtual double residual() = 0;
+
+    protected:
+        mapping map;
+        symbolic S;
+        solver *op;
+};
+
+// number of blocks of the system, solved one after the other
+extern const int n_solver_blocks;
+
+// returns the solver context of block `block' (0 <= block < n_solver_blocks),
+// C linkage so that it can be found with dlsym() in a JIT compiled model
+extern "C" solver_context *create_solver_context(int block);
+
+struct newton_stats {
+    int iterations;     // number of Newton iterations
+    int backtracks;     // total number of step reductions of the line search
+    int failed_searches;    // line searches that ran out of step reductions
+    int assemblies;     // number of operators assembled and factorized
+    double error;       // max norm of the last correction
+    double residual;    // max norm of the residual at the solution
+    bool converged;
+};
+
+// Newton iterations on all the blocks until the correction is below `tol',
+// generated when ester-lang is called with -newton (or -modified-newton,
+// which reuses operators across iterations)
+extern "C" newton_stats newton_solve(double tol = 1e-12, int max_it = 100,
+        int verbose = 1);
+
+#endif